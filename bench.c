@@ -0,0 +1,115 @@
+/*
+ * Tiny load generator for the file server.
+ * Sends the same GET request over and over, one connection per request (like the server
+ * handles them), and prints requests per second and the mean latency.
+ *
+ * usage: ./bench.out <unix:path | ipv4:port | [ipv6]:port> <path> <requests>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define BUFFER_SIZE 65536
+
+/* turns a listener address into a socket address, returns -1 if it can't be parsed */
+int parse_address(const char* spec, struct sockaddr_storage* address, socklen_t* address_length)
+{
+	struct sockaddr_un* unix_address = (struct sockaddr_un*) address;
+	struct sockaddr_in* ipv4_address = (struct sockaddr_in*) address;
+	struct sockaddr_in6* ipv6_address = (struct sockaddr_in6*) address;
+	char host[256];
+	char* port;
+
+	memset(address, 0, sizeof(*address));
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		if (strlen(spec + 5) >= sizeof(unix_address->sun_path))
+			return -1;
+
+		unix_address->sun_family = AF_UNIX;
+		strcpy(unix_address->sun_path, spec + 5);
+		*address_length = sizeof(*unix_address);
+
+		return 0;
+	}
+
+	snprintf(host, sizeof(host), "%s", spec);
+
+	if ((port = strrchr(host, ':')) == NULL)
+		return -1;
+
+	*port++ = '\0';
+
+	if (host[0] == '[') {
+		host[strlen(host) - 1] = '\0';
+		ipv6_address->sin6_family = AF_INET6;
+		ipv6_address->sin6_port = htons(atoi(port));
+		*address_length = sizeof(*ipv6_address);
+
+		return inet_pton(AF_INET6, host + 1, &ipv6_address->sin6_addr) == 1 ? 0 : -1;
+	}
+
+	ipv4_address->sin_family = AF_INET;
+	ipv4_address->sin_port = htons(atoi(port));
+	*address_length = sizeof(*ipv4_address);
+
+	return inet_pton(AF_INET, host, &ipv4_address->sin_addr) == 1 ? 0 : -1;
+}
+
+double now(void)
+{
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+	struct sockaddr_storage address;
+	socklen_t address_length;
+	char request[1024], buffer[BUFFER_SIZE];
+	int request_length, fd;
+	long requests, i, failed = 0, bytes = 0;
+	ssize_t read_length;
+	double start, elapsed;
+
+	if (argc != 4 || parse_address(argv[1], &address, &address_length) != 0 || (requests = atol(argv[3])) <= 0) {
+		fprintf(stderr, "usage: %s <unix:path | ipv4:port | [ipv6]:port> <path> <requests>\n", argv[0]);
+		return 1;
+	}
+
+	request_length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n", argv[2]);
+	start = now();
+
+	for (i = 0; requests > i; i++) {
+		if ((fd = socket(address.ss_family, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr*) &address, address_length) < 0) {
+			failed++;
+
+			if (fd >= 0) close(fd);
+			continue;
+		}
+
+		send(fd, request, request_length, 0);
+
+		/* the server closes the connection after the response */
+		while ((read_length = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+			bytes += read_length;
+
+		close(fd);
+	}
+
+	elapsed = now() - start;
+
+	printf("%-32s %8.0f req/s %8.1f us/req %8.1f MB/s (%ld failed)\n", argv[1], requests / elapsed, elapsed / requests * 1e6, bytes / elapsed / 1e6, failed);
+
+	return failed ? 1 : 0;
+}
@@ -1,23 +1,69 @@
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <math.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/dir.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/xattr.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#else
+/* without systemtap's header (make detects it) the probes compile to nothing */
+#define DTRACE_PROBE2(provider, name, a, b)
+#define DTRACE_PROBE3(provider, name, a, b, c)
+#endif
 
 #include "auth.c"
-
-
-#define HOST_PORT 8081
+#include "sha256.c"
+
+
+#define DEFAULT_LISTENER "0.0.0.0:8081"
+#define MAX_LISTENERS 16
+#define HANDOFF_TIMEOUT 10 /* seconds a new process waits for the running one to hand its sockets over */
+#define HANDOFF_MESSAGE_SIZE 4096
+#define DRAIN_TIMEOUT 30 /* seconds to finish what's in flight once the server stops accepting */
+#define MAX_TRANSFERS 256 /* file bodies being sent at the same time */
+#define SEND_QUANTUM 65536 /* bytes a transfer may send per round of the scheduler */
+#define MAX_CLIENTS 256 /* clients (addresses) rate limits are tracked for */
+#define TOKEN_BUCKET_BURST 0.25 /* seconds worth of rate a bucket can save up */
+#define STATS_PATH "/.micro/stats"
+#define TRACE_PATH "/.micro/trace"
+#define TRACE_RING_SIZE 64 /* slow requests kept for TRACE_PATH */
+#define MAX_PEERS 8
+#define PEER_TIMEOUT 2 /* seconds to connect to a peer, and for each send to it */
+#define PEER_ANSWER_TIMEOUT 60 /* seconds a peer gets to answer once it has the whole request (it may be hashing a big file), waited for by the main loop */
+#define MAX_REPLICATIONS 16 /* replicated mutations whose peers' answers are waited for at once */
+#define REPLICA_HEADER "X-Micro-Replica" /* on mutations replicated from a peer, they aren't passed on again */
+#define NOT_REPLICATED "Written, but not replicated to enough peers"
+#define NOT_DELETED_ON_PEERS "Deleted, but not on enough peers"
+#define CATCH_UP_SIZE 1024 /* paths kept for peers that missed mutations of them */
+#define CATCH_UP_BATCH 16 /* paths sent per round of the main loop */
+#define CATCH_UP_MAX_RETRY 60 /* seconds between tries to reach a peer that is down, starting at 1 and doubling */
+#define RESERVED_PATH ".micro" /* the server's own files, beneath the root, can't be uploaded to or deleted */
+#define OBJECTS_PATH ".micro/objects" /* content addressed store, a file per sha-256 (-d) */
+#define CONTENT_HASH_XATTR "user.micro.sha256"
+#define OBJECT_REFS_XATTR "user.micro.refs" /* files sharing a stored copy, with -d reflink */
+#define OBJECT_PATH_SIZE (sizeof(OBJECTS_PATH) + SHA256_DIGEST_SIZE * 2 + 1)
 #define BACKLOG 10
 #define BUFFER_SIZE 1024
 #define PATH_BUFFER_SIZE 512
@@ -25,6 +71,22 @@
 #define HEADER_VALUE_SIZE 1024
 #define MAX_HEADER_COUNT 64
 #define SERVER_NAME "micro"
+#define UPLOAD_SEGMENT_SIZE 1048576 /* granularity of the completion bitmap of a segmented upload */
+#define UPLOADS_PATH ".micro/uploads" /* segmented uploads in progress, a .part and a .part.map named after the sha-256 of the file's path */
+#define UPLOAD_PART_SUFFIX ".part"
+#define UPLOAD_MAP_SUFFIX ".part.map"
+#define UPLOAD_PATH_SIZE (sizeof(UPLOADS_PATH) + SHA256_DIGEST_SIZE * 2 + sizeof(UPLOAD_MAP_SUFFIX))
+#define UPLOAD_EXPIRY (24 * 60 * 60) /* seconds a segmented upload is kept without a new segment arriving */
+#define DIR_INDEX_CACHE_SIZE 8 /* number of directories to keep a sorted index of */
+#define LISTING_DEFAULT_LIMIT 1000
+#define LISTING_MAX_LIMIT 10000
+#define TAR_BLOCK_SIZE 512
+#define TAR_MAX_DEPTH 64
+#define TAR_MAX_PAX_SIZE 65536 /* bigger extended headers are skipped */
+#define EXTRACT_BUFFER_SIZE 65536
+#define DEFAULT_ROOT "/"
+#define DIRFD_CACHE_SIZE 32 /* number of open directories kept for resolving paths */
+#define DIRFD_CACHE_TTL 2 /* seconds, bounds how long a directory renamed behind our back keeps being used */
 
 /* this probably shouldn't be changed */
 #define METHOD_BUFFER_SIZE 6
@@ -35,7 +97,6 @@
 #define HEADER_BUFFER_SIZE HEADER_NAME_SIZE + 2 + HEADER_VALUE_SIZE + 2
 #define DIRLEN(entrylen) (entrylen * 2 + 20)
 
-int sfd;
 char running;
 
 enum expecting
@@ -75,6 +136,7 @@ enum parse_error
 	ERR_HEADER_VALUE_TOO_BIG,
 	ERR_EXPECTED_NEW_LINE,
 	ERR_EXPECTED_NAME_VALUE_SPACE,
+	ERR_MALFORMED_PATH,
 	ERR_EXPECTING_UNKNOWN /* this REALLY shouldn't happen, this is internal */
 };
 
@@ -91,9 +153,252 @@ struct request_t
 
 	char path[PATH_BUFFER_SIZE];
 	short psize;
+	char query[PATH_BUFFER_SIZE];
 
 	struct header_t headers[MAX_HEADER_COUNT];
 	short hsize;
+
+	/* body bytes that arrived in the same read as the headers */
+	char body[BUFFER_SIZE];
+	short bsize;
+};
+
+/* on-disk header of the completion bitmap of a segmented upload, followed by the bitmap itself */
+struct upload_map_t
+{
+	char magic[8];
+	long total;
+	long segment_size;
+	long received; /* number of segments that have fully arrived */
+};
+
+struct dir_entry_t
+{
+	char* name;
+	long size;
+	long mtime;
+	unsigned char type; /* DT_* */
+};
+
+/* entries of a directory sorted by name, plus orderings by size and mtime built when first asked for */
+struct dir_index_t
+{
+	char path[PATH_BUFFER_SIZE];
+	struct timespec mtime; /* of the directory itself, changes when entries are added, removed or renamed */
+
+	struct dir_entry_t* entries;
+	long count;
+
+	struct dir_entry_t** by_size;
+	struct dir_entry_t** by_mtime;
+
+	unsigned long last_used;
+};
+
+enum listing_sort
+{
+	S_NAME,
+	S_SIZE,
+	S_MTIME
+};
+
+/* ustar header, one block */
+struct tar_header_t
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char padding[12];
+};
+
+struct buffer_t
+{
+	char* data;
+	size_t length;
+	size_t capacity;
+};
+
+/* an open directory under the served root, so paths in it don't have to be walked from the root again */
+struct dirfd_cache_entry_t
+{
+	char path[PATH_BUFFER_SIZE];
+	int fd;
+	time_t opened;
+	unsigned long last_used;
+};
+
+/* a socket accepting connections, from a -l option */
+struct listener_t
+{
+	const char* spec; /* unix:<path>[:<mode>], <ipv4>:<port> or [<ipv6>]:<port> */
+	int fd;
+	char unix_path[sizeof(((struct sockaddr_un*) 0)->sun_path)]; /* to remove the socket file on exit */
+	ino_t unix_inode; /* a process that replaced this one may have put its own socket file there */
+	char inherited; /* handed over by the process this one replaced */
+};
+
+enum traffic_class
+{
+	T_FILE,
+	T_LISTING,
+	T_ARCHIVE,
+	T_UPLOAD,
+	TRAFFIC_CLASS_COUNT
+};
+
+struct token_bucket_t
+{
+	double rate; /* bytes per second, 0 for unlimited */
+	double tokens;
+	double updated;
+};
+
+/* rate limit state of a client address */
+struct client_t
+{
+	char address[INET6_ADDRSTRLEN];
+	struct token_bucket_t read;
+	struct token_bucket_t upload;
+	int transfers; /* active transfers pointing here, the slot can't be reused while > 0 */
+	unsigned long last_used;
+};
+
+enum trace_phase
+{
+	P_PARSE,
+	P_AUTH,
+	P_STAT,
+	P_OPEN,
+	P_SEND, /* until the last byte is handed to the kernel, for scheduled transfers too */
+	PHASE_COUNT
+};
+
+/* where the time of a request went */
+struct trace_t
+{
+	double started; /* monotonic, when it was accepted */
+	time_t time;
+	double phases[PHASE_COUNT]; /* seconds */
+	char seen[PHASE_COUNT];
+	double total;
+	const char* method;
+	char path[PATH_BUFFER_SIZE];
+	char client[INET6_ADDRSTRLEN];
+	int status;
+};
+
+/* the body of a GET being sent, a quantum per round so big files can't starve the others */
+struct transfer_t
+{
+	int cfd;
+	int fd;
+	off_t offset;
+	off_t end;
+	long deficit;
+	struct client_t* client;
+	double resume_at; /* out of tokens until then */
+	char active;
+	struct trace_t trace; /* of the request, its send phase ends with the transfer */
+	double send_started;
+};
+
+/* another micro server mutations are replicated to, from a -p option */
+struct peer_t
+{
+	const char* spec; /* unix:<path>, <ipv4>:<port> or [<ipv6>]:<port> */
+	struct sockaddr_storage address;
+	socklen_t address_length;
+	int fd; /* connection of the mutation being replicated, -1 when there's none */
+	double retry_at; /* down until then, mutations meanwhile go to the catch up queue right away */
+	double retry_interval;
+	int pending; /* paths queued for it */
+	int in_flight; /* of those, sent and not answered yet */
+};
+
+/* a path a peer missed a mutation of, it's sent the state the path has here later: the file, or a DELETE when there's none */
+struct catch_up_t
+{
+	int peer;
+	char path[PATH_BUFFER_SIZE];
+	char authorization[HEADER_VALUE_SIZE];
+	char used;
+	int fd; /* connection of the catch up request in flight, -1 when there's none */
+	int file_fd; /* the body, sent a quantum per round while the connection takes it, -1 once it's all out (or for a DELETE) */
+	off_t offset;
+	off_t end;
+	double deadline; /* for the next piece of the body to go out, then for its answer */
+	char deleting;
+};
+
+/* when a replicated mutation is acknowledged to the client, -a */
+enum ack_policy
+{
+	A_LOCAL, /* once it's done here */
+	A_QUORUM, /* once it's done on a majority of the nodes, this one included */
+	A_ALL /* once every peer has it too */
+};
+
+/* a response to a mutation, the client gets one of two depending on the peers' answers (-a) */
+struct reply_t
+{
+	const char* status_code;
+	const char* status_text;
+	const char* content_type; /* NULL when there's no body */
+	const char* body;
+	size_t length;
+};
+
+/* a replicated mutation whose peers' answers the main loop waits for */
+struct replication_t
+{
+	char active;
+	int fds[MAX_PEERS]; /* connections of the peers that still owe an answer, -1 otherwise */
+	double deadline;
+	int expected_status; /* the answer that counts as taken, 0 for any 2xx */
+	char failed_here;
+	char deleting;
+	struct buffer_t paths; /* it touched, each ending in a \0 */
+	char authorization[HEADER_VALUE_SIZE];
+	int taken_by;
+	int cfd; /* client held until enough peers answered (-a quorum|all), -1 once it has its response */
+	struct reply_t taken, not_taken;
+	struct trace_t trace;
+};
+
+/* value of the CONTENT_HASH_XATTR of an uploaded file, only trusted while the file still has the size and mtime it was hashed at */
+struct content_hash_t
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	long size;
+	long mtime;
+	long mtime_nsec;
+};
+
+/* what -d does with uploads whose content is already stored */
+enum content_store
+{
+	C_NONE,
+	C_LINK, /* hard link to the stored file */
+	C_REFLINK /* copy on write clone of it (btrfs, xfs) */
+};
+
+struct traffic_counter_t
+{
+	unsigned long bytes;
+	unsigned long requests;
 };
 
 struct response_t
@@ -107,6 +412,70 @@ struct response_t
 	short header_count;
 };
 
+struct listener_t listeners[MAX_LISTENERS];
+int listener_count;
+
+/* unix socket a replacement process connects to, to take the listeners over (-H) */
+const char* handoff_path;
+int handoff_fd = -1;
+ino_t handoff_inode;
+char handed_off;
+
+struct transfer_t transfers[MAX_TRANSFERS];
+int transfer_count;
+char connection_kept; /* set when the connection being handled was handed to a transfer, or held for its peers' answers */
+
+/* -g, -G, -c and -C */
+struct token_bucket_t global_read_bucket, global_upload_bucket;
+double client_read_rate, client_upload_rate;
+
+struct client_t clients[MAX_CLIENTS];
+unsigned long client_clock;
+struct client_t* current_client;
+char current_client_is_local;
+
+const char* TRAFFIC_CLASS_NAMES[] = { "file", "listing", "archive", "upload" };
+struct traffic_counter_t traffic[TRAFFIC_CLASS_COUNT];
+
+/* -T and -S */
+char server_timing;
+double slow_threshold = -1; /* seconds, requests that take at least this long go to the trace ring, < 0 for none */
+
+const char* PHASE_NAMES[] = { "parse", "auth", "stat", "open", "send" };
+struct trace_t current_trace; /* of the request being handled */
+struct trace_t trace_ring[TRACE_RING_SIZE];
+int trace_ring_next, trace_ring_count;
+
+enum content_store content_store;
+
+/* -p and -a */
+struct peer_t peers[MAX_PEERS];
+int peer_count;
+enum ack_policy ack_policy;
+const char* replica_key; /* -k, the value of the replica header between nodes, NULL to go by the peer addresses instead */
+char replicating; /* the body being received goes to the peers too */
+struct replication_t replications[MAX_REPLICATIONS];
+int replication_count;
+struct replication_t* current_replication; /* of the request being handled, NULL if it wasn't replicated */
+
+/* ring of paths to bring peers up to date on, oldest first, removed entries are left unused until they reach the head */
+struct catch_up_t catch_up[CATCH_UP_SIZE];
+int catch_up_head, catch_up_count, catch_up_in_flight;
+
+/* the served directory, every path is resolved beneath it */
+const char* root_path = DEFAULT_ROOT;
+int root_fd;
+char has_openat2 = 1;
+
+struct dirfd_cache_entry_t dirfd_cache[DIRFD_CACHE_SIZE];
+unsigned long dirfd_cache_clock;
+
+/* sorted indexes of the most recently listed directories */
+struct dir_index_t dir_indexes[DIR_INDEX_CACHE_SIZE];
+unsigned long dir_index_clock;
+
+const char TO_BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
 const unsigned int FROM_BASE64[] = {
     80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80,
     80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80, 80,
@@ -145,348 +514,3608 @@ int get_header_index(struct request_t req, const char* header)
 	return -1;
 }
 
-char* http_version_as_string(enum http_version http_version)
+void remove_header(struct request_t* req, int index)
 {
-	switch (http_version) {
-		case V_09:
-			return "HTTP/0.9";
-		
-		case V_10:
-			return "HTTP/1.0";
-		
-		case V_11:
-			return "HTTP/1.1";
-	}
-
-	return ""; 
+	memmove(&req->headers[index], &req->headers[index + 1], (req->hsize - index - 1) * sizeof(req->headers[0]));
+	req->hsize--;
 }
 
-char* method_as_string(enum method method)
+/* a "." or ".." between slashes, either would let a path name a file by more than one spelling */
+int has_dot_component(const char* path)
 {
-	switch (method) {
-		case M_GET:
-			return "GET";
-
-		case M_PUT:
-			return "PUT";
+	const char* component;
 
-		case M_DELETE:
-			return "DELETE";
-	}
+	for (component = path; component; component = strchr(component, '/') ? strchr(component, '/') + 1 : NULL)
+		if (component[0] == '.' && (component[1] == '/' || component[1] == '\0' || (component[1] == '.' && (component[2] == '/' || component[2] == '\0'))))
+			return 1;
 
-	return "";
+	return 0;
 }
 
-void print_request(struct request_t req)
+int has_parent_component(const char* path)
 {
-	int i;
+	const char* component;
 
-	printf("%s %s %s\r\n", method_as_string(req.method), req.path, http_version_as_string(req.http_version));
+	for (component = path; component; component = strchr(component, '/') ? strchr(component, '/') + 1 : NULL)
+		if (strncmp(component, "..", 2) == 0 && (component[2] == '/' || component[2] == '\0'))
+			return 1;
 
-	for (i = 0; req.hsize > i; i++)
-		printf("%s: %s\r\n", req.headers[i].name, req.headers[i].value);
-	
-	printf("\r\n");
+	return 0;
 }
 
-size_t get_response_length(struct response_t res)
+/*
+ * openat() that can't leave dir_fd, through ".." or symlinks. from the root itself, absolute symlinks
+ * and ".." resolve as if it were "/" (like in a chroot), from a subdirectory leaving it fails with EXDEV
+ * so the caller can retry from the root.
+ */
+int openat_beneath(int dir_fd, const char* path, int flags, mode_t mode)
 {
-	int i;
-	size_t s = 0;
+	struct open_how how;
+	int fd;
 
-	s += HTTP_VERSION_SIZE + 1 + STATUS_CODE_SIZE + 1 + strlen(res.status_text) + 2;
-	
-	for (i = 0; res.header_count > i; i++)
-		s += strlen(res.headers[i].name) + 2 + strlen(res.headers[i].value) + 2;
-	
-	s += 2;
-	
-	return s;
+	if (has_openat2) {
+		memset(&how, 0, sizeof(how));
+		how.flags = flags;
+		how.mode = flags & O_CREAT ? mode : 0;
+		how.resolve = dir_fd == root_fd ? RESOLVE_IN_ROOT : RESOLVE_BENEATH;
+
+		if ((fd = syscall(SYS_openat2, dir_fd, path, &how, sizeof(how))) >= 0 || errno != ENOSYS)
+			return fd;
+
+		/* kernel older than 5.6 */
+		fprintf(stderr, SERVER_NAME": warn: openat2 not supported, symlinks can lead out of %s\n", root_path);
+		has_openat2 = 0;
+	}
+
+	if (has_parent_component(path)) {
+		errno = EXDEV;
+		return -1;
+	}
+
+	return openat(dir_fd, path, flags, mode);
 }
 
-void send_response(int cfd, struct response_t response)
+/* fd of a directory under the root, from the cache when it was opened recently */
+int get_dirfd(const char* path)
 {
-	int i;
-	size_t response_length = 0, header_size;
-	char* response_buffer = malloc(get_response_length(response));
+	int i, fd;
+	time_t now = time(NULL);
+	struct dirfd_cache_entry_t* entry = NULL;
 
-	response_length += snprintf(response_buffer + response_length, HTTP_VERSION_SIZE + 1 + STATUS_CODE_SIZE + 1 + strlen(response.status_text) + 2 + 1, "%s %s %s\r\n", http_version_as_string(response.http_version), response.status_code, response.status_text);
+	if (path[0] == '\0' || strcmp(path, ".") == 0)
+		return root_fd;
 
-	for (i = 0; response.header_count > i; i++) {
-		header_size = strlen(response.headers[i].name) + 2 + strlen(response.headers[i].value) + 2 + 1;
-		response_length += snprintf(response_buffer + response_length, header_size, "%s: %s\r\n", response.headers[i].name, response.headers[i].value);
+	for (i = 0; DIRFD_CACHE_SIZE > i; i++) {
+		if (dirfd_cache[i].path[0] && strcmp(dirfd_cache[i].path, path) == 0) {
+			entry = &dirfd_cache[i];
+			break;
+		}
 	}
 
-	response_length += snprintf(response_buffer + response_length, 3, "\r\n");
+	if (entry != NULL && DIRFD_CACHE_TTL > now - entry->opened) {
+		entry->last_used = ++dirfd_cache_clock;
+		return entry->fd;
+	}
 
-	send(cfd, response_buffer, response_length, 0);
-	free(response_buffer);
-}
+	if ((fd = openat_beneath(root_fd, path, O_PATH | O_DIRECTORY, 0)) < 0)
+		return -1;
 
-void send_response_with_content_length(int cfd, const char status_code[STATUS_CODE_SIZE], const char* status_text, const char* content_type, long content_length)
-{
-	/* length of contentlen as a string */
-	long length_of_content_length = content_length == 0 ? 1 : (long) 1 + log10((double) content_length) + 1;
-	char* content_length_buffer = malloc(length_of_content_length);
-	snprintf(content_length_buffer, length_of_content_length, "%ld", content_length);
+	if (entry == NULL) {
+		/* take the least recently used slot */
+		entry = &dirfd_cache[0];
 
-	/* allocate memory for response */
-	struct response_t response = {
-		.http_version = V_11,
-		.status_code = status_code,
-		.status_text = status_text
-	};
+		for (i = 1; DIRFD_CACHE_SIZE > i; i++)
+			if (entry->last_used > dirfd_cache[i].last_used)
+				entry = &dirfd_cache[i];
+	}
 
-	/* content-type header */
-	struct header_t h_content_type = {
-		.name = "Content-Type"
-	};
-	
-	strncpy(h_content_type.value, content_type, strnlen(content_type, HEADER_NAME_SIZE));
-	
-	/* content-length header */
-	struct header_t h_content_length = {
-		.name = "Content-Length"
-	};
-	
-	strncpy(h_content_length.value, content_length_buffer, strnlen(content_length_buffer, HEADER_VALUE_SIZE));
+	if (entry->path[0])
+		close(entry->fd);
 
-	/* construct response */
-	response.headers[0] = H_CONNECTION_CLOSED;
-	response.headers[1] = H_SERVER;
-	response.headers[2] = h_content_type;
-	response.headers[3] = h_content_length;
-	response.header_count = 4;
+	strncpy(entry->path, path, PATH_BUFFER_SIZE - 1);
+	entry->fd = fd;
+	entry->opened = now;
+	entry->last_used = ++dirfd_cache_clock;
 
-	/* send response and clean up */
-	send_response(cfd, response);
-	free(content_length_buffer);
+	return fd;
 }
 
-void send_response_basic(int cfd, const char status_code[STATUS_CODE_SIZE], const char* status_text)
+/* fd of the directory path is in and the name of path in it */
+int get_parent_dirfd(const char* path, const char** name)
 {
-	struct response_t response = {
-		.headers = {
-			H_SERVER,
-			H_CONNECTION_CLOSED
-		},
-		.header_count = 2,
-		.http_version = V_11,
-		.status_text = status_text,
-		.status_code = status_code
-	};
+	char parent[PATH_BUFFER_SIZE];
+	const char* slash = strrchr(path, '/');
 
-	send_response(cfd, response);
+	if (slash == NULL) {
+		*name = path;
+		return root_fd;
+	}
+
+	*name = slash + 1;
+	snprintf(parent, sizeof(parent), "%.*s", (int) (slash - path), path);
+
+	return get_dirfd(parent);
 }
 
-void send_response_with_content(int cfd, const char status_code[STATUS_CODE_SIZE], const char* status_text, const char* content_type, const char* content)
+/* open() of a path relative to the root */
+int open_beneath(const char* path, int flags, mode_t mode)
 {
-	send_response_with_content_length(cfd, status_code, status_text, content_type, strlen(content));
-	send(cfd, content, strlen(content), 0);
+	const char* name;
+	int dir_fd, fd;
+
+	if ((dir_fd = get_parent_dirfd(path, &name)) < 0)
+		return -1;
+
+	/* a symlink pointing elsewhere under the root needs resolving from the root */
+	if ((fd = openat_beneath(dir_fd, name, flags, mode)) < 0 && errno == EXDEV)
+		fd = openat_beneath(root_fd, path, flags, mode);
+
+	return fd;
 }
 
-void send_http_file(int cfd, const char* file_path, size_t file_size)
+/* stat() of a path relative to the root, symlinks are followed as long as they stay beneath it */
+int stat_beneath(const char* path, struct stat* stat_result)
 {
-	size_t read_length;
-	int fd;
-	char file_send_buffer[BUFFER_SIZE];
+	const char* name;
+	int dir_fd, fd, result;
 
-	/* open file */
-	if ((fd = open(file_path, O_RDONLY)) < 0) {
-		send_response_with_content(cfd, "500", "Internal Server Error", "text/html", "Can't open file");
-		return;
-	}
+	if ((dir_fd = get_parent_dirfd(path, &name)) < 0 || fstatat(dir_fd, name, stat_result, AT_SYMLINK_NOFOLLOW) != 0)
+		return -1;
 
-	/* send http response */
-	send_response_with_content_length(cfd, "200", "OK", "application/octet-stream", file_size);
+	if (!S_ISLNK(stat_result->st_mode))
+		return 0;
 
-	/* send file contents */
-	while ((read_length = read(fd, file_send_buffer, BUFFER_SIZE)) > 0)
-		send(cfd, file_send_buffer, read_length, 0);
-	
+	if ((fd = open_beneath(path, O_PATH, 0)) < 0)
+		return -1;
+
+	result = fstat(fd, stat_result);
 	close(fd);
+
+	return result;
 }
 
-void send_not_found(int cfd)
+int statvfs_beneath(const char* path, struct statvfs* fs)
 {
-	send_response_basic(cfd, "404", "Not Found");
+	const char* name;
+	int dir_fd;
+
+	if ((dir_fd = get_parent_dirfd(path, &name)) < 0)
+		return -1;
+
+	return fstatvfs(dir_fd, fs);
 }
 
-void send_directory_entry(int cfd, const struct dirent* entry)
+int unlink_beneath(const char* path)
 {
-	size_t entry_length = strlen(entry->d_name);
+	const char* name;
+	int dir_fd;
 
-	if (entry->d_type == DT_DIR) entry_length++;
+	if ((dir_fd = get_parent_dirfd(path, &name)) < 0)
+		return -1;
 
-	size_t buffer_length = DIRLEN(entry_length);
-	char* send_buffer = malloc(buffer_length);
+	return unlinkat(dir_fd, name, 0);
+}
 
-	/* send entry as link */
-	if (entry->d_type == DT_DIR) {
-		snprintf(send_buffer, buffer_length, "<a href=\"%s/\">%s/</a><br>", entry->d_name, entry->d_name);
-	} else {
-		snprintf(send_buffer, buffer_length, "<a href=\"%s\">%s</a><br>", entry->d_name, entry->d_name);
-	}
+int mkdir_beneath(const char* path, mode_t mode)
+{
+	const char* name;
+	int dir_fd;
 
-	send(cfd, send_buffer, buffer_length - 1, 0); /* don't send the \0 */
-	free(send_buffer);
+	if ((dir_fd = get_parent_dirfd(path, &name)) < 0)
+		return -1;
+
+	return mkdirat(dir_fd, name, mode);
 }
 
-/* special thanks to http://www.sunshine2k.de/articles/coding/base64/understanding_base64.html
- * great explaination of base64
- * original C# algorithm
- * below is my version adapted for C
- */
-char* base64_decode(const char* str)
+int rename_beneath(const char* from, const char* to)
 {
-	size_t len, i, actual_len;
-	char byte_1, byte_2, byte_3, byte_4;
-	size_t counter = 0;
-	char* out_str;
+	const char* from_name;
+	const char* to_name;
+	int from_dir_fd, to_dir_fd;
+
+	if ((from_dir_fd = get_parent_dirfd(from, &from_name)) < 0 || (to_dir_fd = get_parent_dirfd(to, &to_name)) < 0)
+		return -1;
+
+	return renameat(from_dir_fd, from_name, to_dir_fd, to_name);
+}
+
+int link_beneath(const char* from, const char* to)
+{
+	const char* from_name;
+	const char* to_name;
+	int from_dir_fd, to_dir_fd;
+
+	if ((from_dir_fd = get_parent_dirfd(from, &from_name)) < 0 || (to_dir_fd = get_parent_dirfd(to, &to_name)) < 0)
+		return -1;
+
+	return linkat(from_dir_fd, from_name, to_dir_fd, to_name, 0);
+}
+
+/* creates a new file next to path to write to before renaming it over path, its path goes in temporary_path */
+int create_temporary_beneath(const char* path, char* temporary_path, size_t size)
+{
+	static unsigned int counter;
+	const char* name;
+	int fd, tries;
+
+	if (get_parent_dirfd(path, &name) < 0)
+		return -1;
+
+	for (tries = 0; 100 > tries; tries++) {
+		snprintf(temporary_path, size, "%.*s.%s.%d.%u", (int) (name - path), path, name, (int) getpid(), counter++);
+
+		if ((fd = open_beneath(temporary_path, O_RDWR | O_CREAT | O_EXCL, 0666)) >= 0 || errno != EEXIST)
+			return fd;
+	}
+
+	return -1;
+}
+
+DIR* opendir_beneath(const char* path)
+{
+	int fd;
+	DIR* dir;
+
+	if ((fd = open_beneath(path, O_RDONLY | O_DIRECTORY, 0)) < 0)
+		return NULL;
+
+	if ((dir = fdopendir(fd)) == NULL)
+		close(fd);
+
+	return dir;
+}
+
+/* stat_result is of the root directory, under any path that leads to it */
+int is_root_directory(const struct stat* stat_result)
+{
+	struct stat root_stat;
+
+	return fstat(root_fd, &root_stat) == 0 && root_stat.st_dev == stat_result->st_dev && root_stat.st_ino == stat_result->st_ino;
+}
+
+/* the request path relative to the root, "." for the root itself */
+const char* relative_path(const char* path)
+{
+	while (*path == '/')
+		path++;
+
+	return *path ? path : ".";
+}
+
+/* a relative path in the server's own directory */
+int is_reserved_path(const char* path)
+{
+	return strncmp(path, RESERVED_PATH, sizeof(RESERVED_PATH) - 1) == 0 && (path[sizeof(RESERVED_PATH) - 1] == '/' || path[sizeof(RESERVED_PATH) - 1] == '\0');
+}
+
+int from_hex(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+	return -1;
+}
+
+/* decodes %XX escapes in place, returns -1 on a malformed escape */
+int percent_decode(char* str, int plus_as_space)
+{
+	char* out = str;
+	int high, low;
+
+	for (; *str; str++) {
+		if (*str == '%') {
+			if ((high = from_hex(str[1])) < 0 || (low = from_hex(str[2])) < 0)
+				return -1;
+
+			/* a NUL would cut the string short */
+			if (high == 0 && low == 0)
+				return -1;
+
+			*out++ = high << 4 | low;
+			str += 2;
+		} else if (*str == '+' && plus_as_space) {
+			*out++ = ' ';
+		} else {
+			*out++ = *str;
+		}
+	}
+
+	*out = '\0';
+
+	return 0;
+}
+
+/* encodes everything but unreserved characters and the ones in keep, returns the length or -1 if it doesn't fit */
+int percent_encode(const char* str, const char* keep, char* out, size_t size)
+{
+	const char* HEX = "0123456789ABCDEF";
+	size_t length = 0;
+	unsigned char c;
+
+	for (; *str; str++) {
+		c = *str;
+
+		if (length + 4 > size)
+			return -1;
+
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~' || strchr(keep, c) != NULL) {
+			out[length++] = c;
+		} else {
+			out[length++] = '%';
+			out[length++] = HEX[c >> 4];
+			out[length++] = HEX[c & 0x0f];
+		}
+	}
+
+	out[length] = '\0';
+
+	return length;
+}
+
+/* copies the decoded value of a query parameter into value, returns 1 if it was there and 0 if not */
+int get_query_param(struct request_t req, const char* name, char* value, size_t size)
+{
+	char* param;
+	char* separator;
+	size_t name_length = strlen(name), value_length;
+
+	for (param = req.query; *param; param = separator + 1) {
+		separator = strchr(param, '&');
+
+		if (separator == NULL)
+			separator = param + strlen(param);
+
+		if (strncmp(param, name, name_length) == 0 && (param[name_length] == '=' || param + name_length == separator)) {
+			param += name_length;
+
+			if (*param == '=') param++;
+
+			value_length = separator - param;
+
+			if (value_length >= size)
+				return 0;
+
+			memcpy(value, param, value_length);
+			value[value_length] = '\0';
+
+			return percent_decode(value, 1) == 0;
+		}
+
+		if (*separator == '\0')
+			break;
+	}
+
+	return 0;
+}
+
+double monotonic_now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* start of a phase of the request being handled, pass what it returns to phase_end() */
+double phase_start(enum trace_phase phase)
+{
+	DTRACE_PROBE2(micro, phase_start, PHASE_NAMES[phase], current_trace.path);
+
+	return monotonic_now();
+}
+
+void phase_end(struct trace_t* trace, enum trace_phase phase, double started)
+{
+	double elapsed = monotonic_now() - started;
+
+	trace->phases[phase] += elapsed;
+	trace->seen[phase] = 1;
+
+	DTRACE_PROBE3(micro, phase_end, PHASE_NAMES[phase], trace->path, (long) (elapsed * 1e6));
+}
+
+/* a request is over, the slow ones are kept for TRACE_PATH */
+void trace_done(struct trace_t* trace)
+{
+	trace->total = monotonic_now() - trace->started;
+
+	DTRACE_PROBE3(micro, request_done, trace->path, trace->status, (long) (trace->total * 1e6));
+
+	if (slow_threshold < 0 || slow_threshold > trace->total)
+		return;
+
+	trace_ring[trace_ring_next] = *trace;
+	trace_ring_next = (trace_ring_next + 1) % TRACE_RING_SIZE;
+
+	if (TRACE_RING_SIZE > trace_ring_count)
+		trace_ring_count++;
+}
+
+void refill_bucket(struct token_bucket_t* bucket, double now)
+{
+	if (bucket->rate == 0)
+		return;
+
+	bucket->tokens += (now - bucket->updated) * bucket->rate;
+	bucket->updated = now;
+
+	if (bucket->tokens > bucket->rate * TOKEN_BUCKET_BURST)
+		bucket->tokens = bucket->rate * TOKEN_BUCKET_BURST;
+}
+
+/* bytes the bucket lets through right now */
+long bucket_allowance(struct token_bucket_t* bucket)
+{
+	if (bucket == NULL || bucket->rate == 0)
+		return SEND_QUANTUM;
+
+	return bucket->tokens > 0 ? (long) bucket->tokens : 0;
+}
+
+/*
+ * takes bytes out of both buckets, for the paths that run inside the request handler (uploads and archives),
+ * every piece as it goes. they aren't paced, on purpose: the body of an upload is hashed, stored and streamed to
+ * the peers as it's read, and an archive is made while the tree is walked, so both would need to become state
+ * machines resumed by the main loop, and waiting for tokens inside the handler would stall it for everyone. they
+ * run at full speed into debt instead and refuse_over_limit() turns the next one away until it's paid back.
+ */
+void charge_buckets(struct token_bucket_t* global, struct token_bucket_t* client, long bytes)
+{
+	double now = monotonic_now();
+
+	refill_bucket(global, now);
+	global->tokens -= global->rate ? bytes : 0;
+
+	if (client != NULL && client->rate) {
+		refill_bucket(client, now);
+		client->tokens -= bytes;
+	}
+}
+
+/* seconds until a bucket is out of debt, 0 if it isn't */
+double bucket_debt(struct token_bucket_t* bucket)
+{
+	if (bucket == NULL || bucket->rate == 0)
+		return 0;
+
+	refill_bucket(bucket, monotonic_now());
+
+	return bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+}
+
+/* "<bytes per second>[k|m|g]", 0 when unlimited */
+double parse_rate(const char* rate)
+{
+	char* unit;
+	double value = strtod(rate, &unit);
+
+	switch (*unit) {
+		case 'k': case 'K': return value * 1024;
+		case 'm': case 'M': return value * 1024 * 1024;
+		case 'g': case 'G': return value * 1024 * 1024 * 1024;
+	}
+
+	return value;
+}
+
+/* send() of all of data, 0 on success, a peer that went away doesn't raise SIGPIPE */
+int send_all(int fd, const char* data, size_t length)
+{
+	ssize_t sent;
+
+	for (; length > 0; data += sent, length -= sent)
+		if ((sent = send(fd, data, length, MSG_NOSIGNAL)) <= 0)
+			return -1;
+
+	return 0;
+}
+
+void mark_peer_down(struct peer_t* peer)
+{
+	if (peer->retry_interval == 0)
+		fprintf(stderr, SERVER_NAME": warn: peer %s is down, catching it up later\n", peer->spec);
+
+	peer->retry_interval = peer->retry_interval == 0 ? 1 : peer->retry_interval * 2 > CATCH_UP_MAX_RETRY ? CATCH_UP_MAX_RETRY : peer->retry_interval * 2;
+	peer->retry_at = monotonic_now() + peer->retry_interval;
+}
+
+void mark_peer_up(struct peer_t* peer)
+{
+	peer->retry_interval = 0;
+	peer->retry_at = 0;
+}
+
+/* passes a piece of the body of the mutation being replicated on to the peers still taking it */
+void replicate_body(const char* data, size_t length)
+{
+	int i;
+
+	for (i = 0; peer_count > i && replicating; i++) {
+		if (peers[i].fd >= 0 && send_all(peers[i].fd, data, length) != 0) {
+			close(peers[i].fd);
+			peers[i].fd = -1;
+			mark_peer_down(&peers[i]);
+		}
+	}
+}
+
+ssize_t recv_body(int cfd, struct request_t* req, char* buffer, size_t length)
+{
+	size_t n;
+
+	/* hand out the bytes that were read together with the headers first */
+	if (req->bsize > 0) {
+		n = length > (size_t) req->bsize ? (size_t) req->bsize : length;
+		memcpy(buffer, req->body, n);
+		memmove(req->body, req->body + n, req->bsize - n);
+		req->bsize -= n;
+		charge_buckets(&global_upload_bucket, current_client != NULL ? &current_client->upload : NULL, n);
+		replicate_body(buffer, n);
+
+		return n;
+	}
+
+	n = recv(cfd, buffer, length, 0);
+
+	if ((ssize_t) n > 0) {
+		traffic[T_UPLOAD].bytes += n;
+		charge_buckets(&global_upload_bucket, current_client != NULL ? &current_client->upload : NULL, n);
+		replicate_body(buffer, n);
+	}
+
+	return n;
+}
+
+char* http_version_as_string(enum http_version http_version)
+{
+	switch (http_version) {
+		case V_09:
+			return "HTTP/0.9";
+		
+		case V_10:
+			return "HTTP/1.0";
+		
+		case V_11:
+			return "HTTP/1.1";
+	}
+
+	return ""; 
+}
+
+char* method_as_string(enum method method)
+{
+	switch (method) {
+		case M_GET:
+			return "GET";
+
+		case M_PUT:
+			return "PUT";
+
+		case M_DELETE:
+			return "DELETE";
+	}
+
+	return "";
+}
+
+void print_request(struct request_t req)
+{
+	int i;
+
+	printf("%s %s %s\r\n", method_as_string(req.method), req.path, http_version_as_string(req.http_version));
+
+	for (i = 0; req.hsize > i; i++)
+		printf("%s: %s\r\n", req.headers[i].name, req.headers[i].value);
+	
+	printf("\r\n");
+}
+
+size_t get_response_length(struct response_t res)
+{
+	int i;
+	size_t s = 0;
+
+	s += HTTP_VERSION_SIZE + 1 + STATUS_CODE_SIZE + 1 + strlen(res.status_text) + 2;
+	
+	for (i = 0; res.header_count > i; i++)
+		s += strlen(res.headers[i].name) + 2 + strlen(res.headers[i].value) + 2;
+	
+	s += 2;
+	
+	return s;
+}
+
+/* Server-Timing header with the phases of the request so far, in milliseconds (-T) */
+void set_server_timing(struct header_t* header)
+{
+	size_t length = 0;
+	int i;
+
+	strcpy(header->name, "Server-Timing");
+
+	for (i = 0; PHASE_COUNT > i; i++)
+		if (current_trace.seen[i])
+			length += snprintf(header->value + length, HEADER_VALUE_SIZE - length, "%s;dur=%.3f, ", PHASE_NAMES[i], current_trace.phases[i] * 1000);
+
+	snprintf(header->value + length, HEADER_VALUE_SIZE - length, "total;dur=%.3f", (monotonic_now() - current_trace.started) * 1000);
+}
+
+void send_response(int cfd, struct response_t response)
+{
+	int i;
+	size_t response_length = 0, header_size;
+	char* response_buffer;
+
+	/* 100 Continue isn't the answer */
+	if (response.status_code[0] != '1') {
+		current_trace.status = atoi(response.status_code);
+
+		if (server_timing && MAX_HEADER_COUNT > response.header_count)
+			set_server_timing(&response.headers[response.header_count++]);
+	}
+
+	/* snprintf() ends every piece with a \0, the last one's lands after the response */
+	response_buffer = malloc(get_response_length(response) + 1);
+
+	response_length += snprintf(response_buffer + response_length, HTTP_VERSION_SIZE + 1 + STATUS_CODE_SIZE + 1 + strlen(response.status_text) + 2 + 1, "%s %s %s\r\n", http_version_as_string(response.http_version), response.status_code, response.status_text);
+
+	for (i = 0; response.header_count > i; i++) {
+		header_size = strlen(response.headers[i].name) + 2 + strlen(response.headers[i].value) + 2 + 1;
+		response_length += snprintf(response_buffer + response_length, header_size, "%s: %s\r\n", response.headers[i].name, response.headers[i].value);
+	}
+
+	response_length += snprintf(response_buffer + response_length, 3, "\r\n");
+
+	send(cfd, response_buffer, response_length, 0);
+	free(response_buffer);
+}
+
+void send_response_with_headers(int cfd, const char status_code[STATUS_CODE_SIZE], const char* status_text, const char* content_type, long content_length, const struct header_t* headers, int header_count)
+{
+	int i;
+
+	/* allocate memory for response */
+	struct response_t response = {
+		.http_version = V_11,
+		.status_code = status_code,
+		.status_text = status_text
+	};
+
+	/* content-type header */
+	struct header_t h_content_type = {
+		.name = "Content-Type"
+	};
+	
+	strncpy(h_content_type.value, content_type, strnlen(content_type, HEADER_NAME_SIZE));
+	
+	/* content-length header */
+	struct header_t h_content_length = {
+		.name = "Content-Length"
+	};
+	
+	snprintf(h_content_length.value, HEADER_VALUE_SIZE, "%ld", content_length);
+
+	/* construct response */
+	response.headers[0] = H_CONNECTION_CLOSED;
+	response.headers[1] = H_SERVER;
+	response.headers[2] = h_content_type;
+	response.header_count = 3;
+
+	/* no length means the body runs until the connection is closed */
+	if (content_length >= 0)
+		response.headers[response.header_count++] = h_content_length;
+
+	for (i = 0; header_count > i && MAX_HEADER_COUNT > response.header_count; i++)
+		response.headers[response.header_count++] = headers[i];
+
+	/* send response */
+	send_response(cfd, response);
+}
+
+void send_response_with_content_length(int cfd, const char status_code[STATUS_CODE_SIZE], const char* status_text, const char* content_type, long content_length)
+{
+	send_response_with_headers(cfd, status_code, status_text, content_type, content_length, NULL, 0);
+}
+
+void send_response_basic(int cfd, const char status_code[STATUS_CODE_SIZE], const char* status_text)
+{
+	struct response_t response = {
+		.headers = {
+			H_SERVER,
+			H_CONNECTION_CLOSED
+		},
+		.header_count = 2,
+		.http_version = V_11,
+		.status_text = status_text,
+		.status_code = status_code
+	};
+
+	send_response(cfd, response);
+}
+
+void send_response_with_content(int cfd, const char status_code[STATUS_CODE_SIZE], const char* status_text, const char* content_type, const char* content)
+{
+	send_response_with_content_length(cfd, status_code, status_text, content_type, strlen(content));
+	send(cfd, content, strlen(content), 0);
+}
+
+/*
+ * turns an upload or archive away while the client (429) or everyone (503) is over the rate limit,
+ * with how long to wait in Retry-After. returns 1 if it did
+ */
+int refuse_over_limit(int cfd, struct token_bucket_t* global, struct token_bucket_t* client)
+{
+	double global_wait = bucket_debt(global), client_wait = bucket_debt(client);
+	struct header_t h_retry_after = {
+		.name = "Retry-After"
+	};
+
+	if (global_wait == 0 && client_wait == 0)
+		return 0;
+
+	snprintf(h_retry_after.value, HEADER_VALUE_SIZE, "%ld", (long) (global_wait > client_wait ? global_wait : client_wait) + 1);
+
+	if (client_wait >= global_wait) {
+		send_response_with_headers(cfd, "429", "Too Many Requests", "text/html", 0, &h_retry_after, 1);
+	} else {
+		send_response_with_headers(cfd, "503", "Service Unavailable", "text/html", 0, &h_retry_after, 1);
+	}
+
+	return 1;
+}
+
+/* finds (or makes room for) the rate limit state of a client address */
+struct client_t* get_client(const struct sockaddr_storage* address)
+{
+	char name[INET6_ADDRSTRLEN];
+	struct client_t* client = NULL;
+	int i;
+
+	if (address->ss_family == AF_INET) {
+		inet_ntop(AF_INET, &((struct sockaddr_in*) address)->sin_addr, name, sizeof(name));
+	} else if (address->ss_family == AF_INET6) {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*) address)->sin6_addr, name, sizeof(name));
+	} else {
+		strcpy(name, "unix");
+	}
+
+	for (i = 0; MAX_CLIENTS > i; i++) {
+		if (strcmp(clients[i].address, name) == 0) {
+			clients[i].last_used = ++client_clock;
+			return &clients[i];
+		}
+
+		/* least recently used one that nothing points to */
+		if (clients[i].transfers == 0 && (client == NULL || client->last_used > clients[i].last_used))
+			client = &clients[i];
+	}
+
+	if (client == NULL)
+		return NULL;
+
+	memset(client, 0, sizeof(*client));
+	strcpy(client->address, name);
+	client->read.rate = client_read_rate;
+	client->read.tokens = client_read_rate * TOKEN_BUCKET_BURST;
+	client->read.updated = monotonic_now();
+	client->upload = client->read;
+	client->upload.rate = client_upload_rate;
+	client->upload.tokens = client_upload_rate * TOKEN_BUCKET_BURST;
+	client->last_used = ++client_clock;
+
+	return client;
+}
+
+int is_local_address(const struct sockaddr_storage* address)
+{
+	const struct in6_addr* ipv6_address = &((struct sockaddr_in6*) address)->sin6_addr;
+
+	if (address->ss_family == AF_UNIX)
+		return 1;
+
+	if (address->ss_family == AF_INET)
+		return (ntohl(((struct sockaddr_in*) address)->sin_addr.s_addr) >> 24) == 127;
+
+	return IN6_IS_ADDR_LOOPBACK(ipv6_address) || (IN6_IS_ADDR_V4MAPPED(ipv6_address) && ipv6_address->s6_addr[12] == 127);
+}
+
+/* the host of one of the -p peers, the port doesn't matter: they connect from any. Unix socket clients count when a peer is one */
+int is_peer_address(const struct sockaddr_storage* address)
+{
+	const struct in6_addr* ipv6_address = &((struct sockaddr_in6*) address)->sin6_addr;
+	const struct sockaddr_storage* peer_address;
+	int i;
+
+	for (i = 0; peer_count > i; i++) {
+		peer_address = &peers[i].address;
+
+		if (address->ss_family == AF_UNIX && peer_address->ss_family == AF_UNIX)
+			return 1;
+
+		if (address->ss_family == AF_INET && peer_address->ss_family == AF_INET && ((struct sockaddr_in*) address)->sin_addr.s_addr == ((struct sockaddr_in*) peer_address)->sin_addr.s_addr)
+			return 1;
+
+		if (address->ss_family == AF_INET6 && peer_address->ss_family == AF_INET6 && IN6_ARE_ADDR_EQUAL(ipv6_address, &((struct sockaddr_in6*) peer_address)->sin6_addr))
+			return 1;
+
+		/* a dual-stack listener sees ipv4 peers as mapped addresses */
+		if (address->ss_family == AF_INET6 && peer_address->ss_family == AF_INET && IN6_IS_ADDR_V4MAPPED(ipv6_address) && memcmp(&ipv6_address->s6_addr[12], &((struct sockaddr_in*) peer_address)->sin_addr, 4) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* a mutation replicated from another node: with -k it must carry the key, otherwise come from a peer's address */
+int is_replica_request(const struct request_t* req, const struct sockaddr_storage* client_address)
+{
+	int header_index = get_header_index(*req, REPLICA_HEADER);
+
+	if (header_index == -1)
+		return 0;
+
+	if (replica_key != NULL)
+		return strcmp(req->headers[header_index].value, replica_key) == 0;
+
+	return is_peer_address(client_address);
+}
+
+/* hands the rest of a response body to the scheduler, returns -1 if it is full */
+int schedule_transfer(int cfd, int fd, off_t size, double send_started)
+{
+	int i;
+
+	for (i = 0; MAX_TRANSFERS > i; i++) {
+		if (transfers[i].active)
+			continue;
+
+		/* from now on this connection only gets written to when it can take it */
+		fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+		transfers[i].cfd = cfd;
+		transfers[i].fd = fd;
+		transfers[i].offset = 0;
+		transfers[i].end = size;
+		transfers[i].deficit = 0;
+		transfers[i].client = current_client;
+		transfers[i].resume_at = 0;
+		transfers[i].active = 1;
+		transfers[i].trace = current_trace;
+		transfers[i].send_started = send_started;
+
+		if (current_client != NULL)
+			current_client->transfers++;
+
+		transfer_count++;
+		connection_kept = 1;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+void finish_transfer(struct transfer_t* transfer)
+{
+	close(transfer->fd);
+	close(transfer->cfd);
+
+	phase_end(&transfer->trace, P_SEND, transfer->send_started);
+	trace_done(&transfer->trace);
+
+	if (transfer->client != NULL)
+		transfer->client->transfers--;
+
+	transfer->active = 0;
+	transfer_count--;
+}
+
+/*
+ * one round of deficit round-robin over the transfers that can be written to: each gets a quantum
+ * of credit and sends as much of it as the rate limits allow. unused credit carries over to the next
+ * round, so a transfer held back by its client's limit catches up when tokens come back. each round
+ * starts after the last transfer that sent something, so shared tokens don't always go to the same one.
+ */
+void run_transfers(struct pollfd* poll_fds, int* poll_index)
+{
+	static int first;
+	struct transfer_t* transfer;
+	long allowed, client_allowed, needed;
+	ssize_t sent;
+	int i, j, next_first = first;
+	double now = monotonic_now(), wait;
+
+	refill_bucket(&global_read_bucket, now);
+
+	for (j = 0; MAX_TRANSFERS > j; j++) {
+		i = (first + j) % MAX_TRANSFERS;
+		transfer = &transfers[i];
+
+		if (!transfer->active)
+			continue;
+
+		if (poll_index[i] < 0 || !(poll_fds[poll_index[i]].revents & (POLLOUT | POLLERR | POLLHUP)))
+			continue;
+
+		if (poll_fds[poll_index[i]].revents & (POLLERR | POLLHUP)) {
+			finish_transfer(transfer);
+			continue;
+		}
+
+		if (transfer->client != NULL)
+			refill_bucket(&transfer->client->read, now);
+
+		transfer->deficit += SEND_QUANTUM;
+
+		if (transfer->deficit > SEND_QUANTUM * 2)
+			transfer->deficit = SEND_QUANTUM * 2;
+
+		allowed = transfer->deficit;
+		client_allowed = transfer->client != NULL ? bucket_allowance(&transfer->client->read) : SEND_QUANTUM * 2;
+
+		if (allowed > bucket_allowance(&global_read_bucket) && global_read_bucket.rate) allowed = bucket_allowance(&global_read_bucket);
+		if (allowed > client_allowed && transfer->client != NULL && transfer->client->read.rate) allowed = client_allowed;
+		if (allowed > transfer->end - transfer->offset) allowed = transfer->end - transfer->offset;
+
+		/* out of tokens, stop polling it until enough for a quantum (or what's left) came back */
+		if (allowed == 0) {
+			needed = transfer->end - transfer->offset > SEND_QUANTUM ? SEND_QUANTUM : transfer->end - transfer->offset;
+			wait = global_read_bucket.rate ? (needed - global_read_bucket.tokens) / global_read_bucket.rate : 0;
+
+			if (transfer->client != NULL && transfer->client->read.rate && (needed - transfer->client->read.tokens) / transfer->client->read.rate > wait)
+				wait = (needed - transfer->client->read.tokens) / transfer->client->read.rate;
+
+			/* a bucket can't save up more than its burst */
+			if (wait > TOKEN_BUCKET_BURST)
+				wait = TOKEN_BUCKET_BURST;
+
+			transfer->resume_at = now + wait;
+			continue;
+		}
+
+		if ((sent = sendfile(transfer->cfd, transfer->fd, &transfer->offset, allowed)) < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				finish_transfer(transfer);
+
+			continue;
+		}
+
+		transfer->deficit -= sent;
+		traffic[T_FILE].bytes += sent;
+		next_first = (i + 1) % MAX_TRANSFERS;
+
+		if (global_read_bucket.rate) global_read_bucket.tokens -= sent;
+		if (transfer->client != NULL && transfer->client->read.rate) transfer->client->read.tokens -= sent;
+
+		/* done, or the file shrank under us */
+		if (transfer->offset >= transfer->end || sent == 0)
+			finish_transfer(transfer);
+	}
+
+	first = next_first;
+}
+
+void hex_encode(const unsigned char* data, size_t length, char* out)
+{
+	size_t i;
+
+	for (i = 0; length > i; i++)
+		sprintf(out + i * 2, "%02x", data[i]);
+
+	out[length * 2] = '\0';
+}
+
+/* out needs room for (length + 2) / 3 * 4 + 1 characters */
+void base64_encode(const unsigned char* data, size_t length, char* out)
+{
+	size_t i;
+	unsigned long bits;
+
+	for (i = 0; length > i; i += 3) {
+		bits = (unsigned long) data[i] << 16 | (length > i + 1 ? data[i + 1] << 8 : 0) | (length > i + 2 ? data[i + 2] : 0);
+
+		*out++ = TO_BASE64[bits >> 18 & 0x3f];
+		*out++ = TO_BASE64[bits >> 12 & 0x3f];
+		*out++ = length > i + 1 ? TO_BASE64[bits >> 6 & 0x3f] : '=';
+		*out++ = length > i + 2 ? TO_BASE64[bits & 0x3f] : '=';
+	}
+
+	*out = '\0';
+}
+
+/* the hash recorded when fd was uploaded, returns 1 if there is one and the file hasn't changed since */
+int get_content_hash(int fd, const struct stat* stat_result, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	struct content_hash_t hash;
+
+	if (fgetxattr(fd, CONTENT_HASH_XATTR, &hash, sizeof(hash)) != sizeof(hash) || hash.size != stat_result->st_size
+		|| hash.mtime != stat_result->st_mtim.tv_sec || hash.mtime_nsec != stat_result->st_mtim.tv_nsec)
+		return 0;
+
+	memcpy(digest, hash.digest, SHA256_DIGEST_SIZE);
+
+	return 1;
+}
+
+/* must be called once fd is written for good, the hash is tied to the current size and mtime */
+int record_content_hash(int fd, const unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	struct content_hash_t hash;
+	struct stat stat_result;
+
+	if (fstat(fd, &stat_result) != 0)
+		return -1;
+
+	memset(&hash, 0, sizeof(hash));
+	memcpy(hash.digest, digest, SHA256_DIGEST_SIZE);
+	hash.size = stat_result.st_size;
+	hash.mtime = stat_result.st_mtim.tv_sec;
+	hash.mtime_nsec = stat_result.st_mtim.tv_nsec;
+
+	return fsetxattr(fd, CONTENT_HASH_XATTR, &hash, sizeof(hash), 0);
+}
+
+/* sha-256 of the whole file, for uploads whose bytes didn't arrive in order */
+int hash_file(int fd, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	struct sha256_t sha;
+	char buffer[EXTRACT_BUFFER_SIZE];
+	ssize_t read_length;
+	off_t offset = 0;
+
+	sha256_init(&sha);
+
+	while ((read_length = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+		sha256_update(&sha, buffer, read_length);
+		offset += read_length;
+	}
+
+	sha256_final(&sha, digest);
+
+	return read_length == 0 ? 0 : -1;
+}
+
+void get_object_path(const unsigned char digest[SHA256_DIGEST_SIZE], char object_path[OBJECT_PATH_SIZE])
+{
+	char hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+	hex_encode(digest, SHA256_DIGEST_SIZE, hex);
+	snprintf(object_path, OBJECT_PATH_SIZE, OBJECTS_PATH"/%s", hex);
+}
+
+/* where the state of a segmented upload of path is kept, out of the served tree */
+void get_upload_paths(const char* path, char part_path[UPLOAD_PATH_SIZE], char map_path[UPLOAD_PATH_SIZE])
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	char hex[SHA256_DIGEST_SIZE * 2 + 1];
+	struct sha256_t sha;
+
+	sha256_init(&sha);
+	sha256_update(&sha, path, strlen(path));
+	sha256_final(&sha, digest);
+	hex_encode(digest, SHA256_DIGEST_SIZE, hex);
+
+	snprintf(part_path, UPLOAD_PATH_SIZE, UPLOADS_PATH"/%s"UPLOAD_PART_SUFFIX, hex);
+	snprintf(map_path, UPLOAD_PATH_SIZE, UPLOADS_PATH"/%s"UPLOAD_MAP_SUFFIX, hex);
+}
+
+/* removes segmented uploads that haven't had a segment for UPLOAD_EXPIRY, the client gave up on them */
+void expire_uploads()
+{
+	DIR* dir;
+	struct dirent* entry;
+	struct stat stat_result;
+	time_t now = time(NULL);
+
+	if ((dir = opendir_beneath(UPLOADS_PATH)) == NULL)
+		return;
+
+	while ((entry = readdir(dir)) != NULL)
+		if (entry->d_name[0] != '.' && fstatat(dirfd(dir), entry->d_name, &stat_result, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(stat_result.st_mode) && now - stat_result.st_mtime > UPLOAD_EXPIRY)
+			unlinkat(dirfd(dir), entry->d_name, 0);
+
+	closedir(dir);
+}
+
+/* changes the count of files sharing the stored copy object_fd (kept for reflinks, hard links count themselves), returns the new count */
+long add_object_refs(int object_fd, long change)
+{
+	long refs;
+
+	if (fgetxattr(object_fd, OBJECT_REFS_XATTR, &refs, sizeof(refs)) != sizeof(refs))
+		refs = 0;
+
+	refs = refs + change > 0 ? refs + change : 0;
+	fsetxattr(object_fd, OBJECT_REFS_XATTR, &refs, sizeof(refs), 0);
+
+	return refs;
+}
+
+/* the hash of an uploaded file, before it's deleted or replaced. symlinks have none, their target isn't going anywhere */
+int get_path_content_hash(const char* path, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	struct stat stat_result;
+	int fd, found;
+
+	if ((fd = open_beneath(path, O_RDONLY | O_NOFOLLOW, 0)) < 0)
+		return 0;
+
+	found = fstat(fd, &stat_result) == 0 && get_content_hash(fd, &stat_result, digest);
+	close(fd);
+
+	return found;
+}
+
+/* a file with this content was deleted or replaced, the stored copy goes once no other file shares it */
+void release_object(const unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	char object_path[OBJECT_PATH_SIZE];
+	struct stat stat_result;
+	int object_fd;
+
+	get_object_path(digest, object_path);
+
+	if (content_store == C_LINK) {
+		/* the store's own link is the last one */
+		if (stat_beneath(object_path, &stat_result) == 0 && stat_result.st_nlink == 1)
+			unlink_beneath(object_path);
+	} else if (content_store == C_REFLINK && (object_fd = open_beneath(object_path, O_RDONLY, 0)) >= 0) {
+		if (add_object_refs(object_fd, -1) == 0)
+			unlink_beneath(object_path);
+
+		close(object_fd);
+	}
+}
+
+/* new content, the stored copy is what later uploads of the same bytes will share */
+void store_object(int fd, const char* temporary_path, const char* object_path, const unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	char object_temporary_path[OBJECT_PATH_SIZE * 2 + 32];
+	int object_fd;
+
+	if (content_store == C_LINK) {
+		link_beneath(temporary_path, object_path);
+		return;
+	}
+
+	if ((object_fd = create_temporary_beneath(object_path, object_temporary_path, sizeof(object_temporary_path))) < 0)
+		return;
+
+	if (ioctl(object_fd, FICLONE, fd) != 0 || record_content_hash(object_fd, digest) != 0 || add_object_refs(object_fd, 1) != 1
+		|| rename_beneath(object_temporary_path, object_path) != 0) {
+		fprintf(stderr, SERVER_NAME": warn: can't clone uploads into %s (%s), the filesystem needs reflink support\n", OBJECTS_PATH, strerror(errno));
+		unlink_beneath(object_temporary_path);
+	}
+
+	close(object_fd);
+}
+
+/*
+ * last step of an upload: the finished temporary file *fd gets its hash recorded and is renamed over path.
+ * with -d, content the object store already has is shared with the stored copy instead of kept twice, and
+ * new content is added to the store. written is 0 when the body was left out because the store had it
+ * already (the temporary file is empty then). *fd may be replaced, returns 0 or -1.
+ */
+int publish_upload(int* fd, const char* temporary_path, const char* path, const unsigned char digest[SHA256_DIGEST_SIZE], int written)
+{
+	char object_path[OBJECT_PATH_SIZE], link_path[PATH_BUFFER_SIZE * 2 + 40];
+	unsigned char replaced_digest[SHA256_DIGEST_SIZE];
+	struct stat stat_result;
+	int object_fd = -1, shared = 0, replaced;
+	off_t offset = 0;
+
+	if (content_store != C_NONE) {
+		get_object_path(digest, object_path);
+		object_fd = open_beneath(object_path, O_RDONLY, 0);
+	}
+
+	if (object_fd >= 0) {
+		if (content_store == C_REFLINK) {
+			shared = ioctl(*fd, FICLONE, object_fd) == 0;
+		} else {
+			/* link under another name first, the temporary file is kept if that fails */
+			snprintf(link_path, sizeof(link_path), "%s.object", temporary_path);
+
+			if (link_beneath(object_path, link_path) == 0 && rename_beneath(link_path, temporary_path) == 0) {
+				close(*fd);
+				*fd = open_beneath(temporary_path, O_RDONLY, 0);
+				shared = 1;
+			}
+		}
+
+		/* can't be shared (too many links, no reflinks), a copy will do */
+		if (!shared && !written) {
+			fstat(object_fd, &stat_result);
+			while (stat_result.st_size > offset && sendfile(*fd, object_fd, &offset, stat_result.st_size - offset) > 0);
+
+			if (offset != stat_result.st_size) {
+				close(object_fd);
+				return -1;
+			}
+		}
+
+		if (content_store == C_REFLINK)
+			add_object_refs(object_fd, 1);
+
+		close(object_fd);
+	} else if (!written) {
+		/* the stored copy went away in the meantime */
+		return -1;
+	}
+
+	/* no ETag for this one, a filesystem without user xattrs isn't worth a warning per upload */
+	if (*fd < 0 || (record_content_hash(*fd, digest) != 0 && errno != ENOTSUP))
+		fprintf(stderr, SERVER_NAME": warn: can't record the hash of %s\n", path);
+
+	if (content_store != C_NONE && object_fd < 0)
+		store_object(*fd, temporary_path, object_path, digest);
+
+	/* the file being replaced may have been the last one sharing its stored copy */
+	replaced = content_store != C_NONE && get_path_content_hash(path, replaced_digest);
+
+	if (rename_beneath(temporary_path, path) != 0)
+		return -1;
+
+	/* rename() leaves both names alone when they're links to the same stored copy already */
+	unlink_beneath(temporary_path);
+
+	if (replaced)
+		release_object(replaced_digest);
+
+	return 0;
+}
+
+void send_http_file(int cfd, struct request_t* req, const char* file_path)
+{
+	off_t offset = 0;
+	int fd, header_index, header_count = 0, hashed;
+	struct stat stat_result;
+	struct header_t headers[2];
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	char hex[SHA256_DIGEST_SIZE * 2 + 1], base64[(SHA256_DIGEST_SIZE + 2) / 3 * 4 + 1];
+	double started = phase_start(P_OPEN);
+
+	/* open file */
+	if ((fd = open_beneath(file_path, O_RDONLY, 0)) < 0 || fstat(fd, &stat_result) != 0) {
+		phase_end(&current_trace, P_OPEN, started);
+		send_response_with_content(cfd, "500", "Internal Server Error", "text/html", "Can't open file");
+		if (fd >= 0) close(fd);
+		return;
+	}
+
+	hashed = get_content_hash(fd, &stat_result, digest);
+	phase_end(&current_trace, P_OPEN, started);
+
+	/* files uploaded here have a hash, it makes a strong ETag */
+	if (hashed) {
+		hex_encode(digest, SHA256_DIGEST_SIZE, hex);
+		base64_encode(digest, SHA256_DIGEST_SIZE, base64);
+
+		strcpy(headers[0].name, "ETag");
+		snprintf(headers[0].value, HEADER_VALUE_SIZE, "\"%s\"", hex);
+		strcpy(headers[1].name, "Digest");
+		snprintf(headers[1].value, HEADER_VALUE_SIZE, "sha-256=%s", base64);
+		header_count = 2;
+
+		/* the client has it already */
+		if ((header_index = get_header_index(*req, "If-None-Match")) != -1 && (strstr(req->headers[header_index].value, headers[0].value) != NULL || strcmp(req->headers[header_index].value, "*") == 0)) {
+			send_response_with_headers(cfd, "304", "Not Modified", "application/octet-stream", -1, headers, 1);
+			close(fd);
+			return;
+		}
+	}
+
+	/* send http response */
+	send_response_with_headers(cfd, "200", "OK", "application/octet-stream", stat_result.st_size, headers, header_count);
+	traffic[T_FILE].requests++;
+	started = phase_start(P_SEND);
+
+	/* the scheduler sends the file contents, alongside the other transfers */
+	if (stat_result.st_size > 0 && schedule_transfer(cfd, fd, stat_result.st_size, started) == 0)
+		return;
+
+	/* too many transfers at once, send it right away */
+	while (stat_result.st_size > offset && sendfile(cfd, fd, &offset, stat_result.st_size - offset) > 0);
+
+	phase_end(&current_trace, P_SEND, started);
+	traffic[T_FILE].bytes += offset;
+	close(fd);
+}
+
+void send_not_found(int cfd)
+{
+	send_response_basic(cfd, "404", "Not Found");
+}
+
+void send_directory_entry(int cfd, const struct dirent* entry)
+{
+	size_t entry_length = strlen(entry->d_name);
+
+	if (entry->d_type == DT_DIR) entry_length++;
+
+	size_t buffer_length = DIRLEN(entry_length);
+	char* send_buffer = malloc(buffer_length);
+
+	/* send entry as link */
+	if (entry->d_type == DT_DIR) {
+		snprintf(send_buffer, buffer_length, "<a href=\"%s/\">%s/</a><br>", entry->d_name, entry->d_name);
+	} else {
+		snprintf(send_buffer, buffer_length, "<a href=\"%s\">%s</a><br>", entry->d_name, entry->d_name);
+	}
+
+	send(cfd, send_buffer, buffer_length - 1, 0); /* don't send the \0 */
+	free(send_buffer);
+}
+
+/* special thanks to http://www.sunshine2k.de/articles/coding/base64/understanding_base64.html
+ * great explaination of base64
+ * original C# algorithm
+ * below is my version adapted for C
+ */
+char* base64_decode(const char* str)
+{
+	size_t len, i, actual_len;
+	char byte_1, byte_2, byte_3, byte_4;
+	size_t counter = 0;
+	char* out_str;
 
 	len = strlen(str);
 
-	/* all base64 strings must be divisible by 4 */
-	if (len % 4 != 0)
-		return NULL;
-	
-	actual_len = len / 4 * 3 + 1; /* +1 for null byte */
-	out_str = malloc(actual_len);
+	/* all base64 strings must be divisible by 4 */
+	if (len % 4 != 0)
+		return NULL;
+	
+	actual_len = len / 4 * 3 + 1; /* +1 for null byte */
+	out_str = malloc(actual_len);
+
+	for (i = 0; len > i; i += 4) {
+		byte_1 = FROM_BASE64[(unsigned int) str[i]];
+		byte_2 = FROM_BASE64[(unsigned int) str[i + 1]];
+		byte_3 = FROM_BASE64[(unsigned int) str[i + 2]];
+		byte_4 = FROM_BASE64[(unsigned int) str[i + 3]];
+
+		if (str[i + 3] == '=') {	
+			if (str[i + 2] == '=') {
+				out_str[counter++] = byte_1 << 2 | ((byte_2 & 0xf0) >> 4);
+			} else {
+				out_str[counter++] = byte_1 << 2 | ((byte_2 & 0xf0) >> 4);
+				out_str[counter++] = ((byte_2 & 0x0f) << 4) | ((byte_3 & 0x3c) >> 2);
+			}
+		} else {
+			out_str[counter++] = byte_1 << 2 | ((byte_2 & 0xf0) >> 4);
+			out_str[counter++] = ((byte_2 & 0x0f) << 4) | ((byte_3 & 0x3c) >> 2);
+			out_str[counter++] = ((byte_3 & 0x03) << 6) | (byte_4 & 0x3f);
+		}
+	}
+
+	/* need null byte */
+	out_str[counter++] = '\0';
+
+	return out_str;
+}
+
+/* the sha-256 a client gave for the body, "Digest: sha-256=<base64>", returns 1 if there is one */
+int get_request_digest(struct request_t* req, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	int header_index;
+	char encoded[(SHA256_DIGEST_SIZE + 2) / 3 * 4 + 1];
+	char* value;
+	char* decoded;
+
+	if ((header_index = get_header_index(*req, "Digest")) == -1 || (value = strstr(req->headers[header_index].value, "sha-256=")) == NULL)
+		return 0;
+
+	value += strlen("sha-256=");
+
+	if (strcspn(value, ", ") != sizeof(encoded) - 1)
+		return 0;
+
+	memcpy(encoded, value, sizeof(encoded) - 1);
+	encoded[sizeof(encoded) - 1] = '\0';
+
+	if ((decoded = base64_decode(encoded)) == NULL)
+		return 0;
+
+	memcpy(digest, decoded, SHA256_DIGEST_SIZE);
+	free(decoded);
+
+	return 1;
+}
+
+int is_authenticated_http(struct request_t req)
+{
+	int header_index;
+	char authenticated;
+	char* decoded;
+	double started;
+
+	if (!(header_index = get_header_index(req, "Authorization"))) {
+		return -1;
+	}
+
+	struct header_t authorization = req.headers[header_index];
+	
+	const char* schema = strtok(authorization.value, " ");
+	const char* encoded = strtok(NULL, " ");
+
+	if (schema == NULL || encoded == NULL)
+		return -2;
+
+	decoded = base64_decode(encoded);  /* [!!] this allocates, MUST free */
+
+	if (decoded == NULL) {
+		free(decoded);
+		return -3;
+	}
+
+	const char* username = strtok(decoded, ":");
+	const char* password = strtok(NULL, ":");
+
+	if (username == NULL || password == NULL) {
+		free(decoded);
+		return -4;
+	}
+
+	started = phase_start(P_AUTH);
+	authenticated = auth_backend(username, password);
+	phase_end(&current_trace, P_AUTH, started);
+
+	free(decoded);
+
+	return authenticated;
+}
+
+void send_directory_listing(int cfd, const char* directory_path)
+{
+
+	DIR* dir;
+	struct dirent* entry;
+	size_t size = 0, name_length;
+
+	/* open directory */
+	if ((dir = opendir_beneath(directory_path)) == NULL) {
+		/* not found */
+		send_not_found(cfd);
+
+		return;
+	}
+
+	/* count for content length */
+	while ((entry = readdir(dir)) != NULL) {
+		name_length = strlen(entry->d_name);
+
+		if (entry->d_type == DT_DIR) name_length++; /* add for the "/" */
+
+		size += DIRLEN(name_length) - 1;
+	}
+	
+	/* start http response */
+	send_response_with_content_length(cfd, "200", "OK", "text/html", size);
+	rewinddir(dir);
+
+	/* iterate through directory and send as HTML */
+	while ((entry = readdir(dir)) != NULL)
+		send_directory_entry(cfd, entry);
+
+	traffic[T_LISTING].bytes += size;
+	traffic[T_LISTING].requests++;
+		
+	/* clean up directory */
+	closedir(dir);
+}
+
+void buffer_append(struct buffer_t* buffer, const char* data, size_t length)
+{
+	if (buffer->length + length > buffer->capacity) {
+		buffer->capacity = (buffer->length + length) * 2;
+		buffer->data = realloc(buffer->data, buffer->capacity);
+	}
+
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+}
+
+void buffer_printf(struct buffer_t* buffer, const char* format, ...)
+{
+	va_list args;
+	char line[BUFFER_SIZE];
+	int length;
+
+	va_start(args, format);
+	length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	if (length > 0)
+		buffer_append(buffer, line, (size_t) length < sizeof(line) ? (size_t) length : sizeof(line) - 1);
+}
+
+void buffer_append_json_string(struct buffer_t* buffer, const char* str)
+{
+	const char* run = str;
+	char escape[8];
+
+	buffer_append(buffer, "\"", 1);
+
+	for (; *str; str++) {
+		if (*str != '"' && *str != '\\' && (unsigned char) *str >= 0x20)
+			continue;
+
+		/* flush the run of characters that don't need escaping */
+		buffer_append(buffer, run, str - run);
+		run = str + 1;
+
+		if (*str == '"' || *str == '\\') {
+			snprintf(escape, sizeof(escape), "\\%c", *str);
+		} else {
+			snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char) *str);
+		}
+
+		buffer_append(buffer, escape, strlen(escape));
+	}
+
+	buffer_append(buffer, run, str - run);
+	buffer_append(buffer, "\"", 1);
+}
+
+int compare_dir_entries_by_name(const void* a, const void* b)
+{
+	return strcmp(((const struct dir_entry_t*) a)->name, ((const struct dir_entry_t*) b)->name);
+}
+
+int compare_dir_entries_by_size(const void* a, const void* b)
+{
+	const struct dir_entry_t* entry_a = *(const struct dir_entry_t**) a;
+	const struct dir_entry_t* entry_b = *(const struct dir_entry_t**) b;
+
+	if (entry_a->size != entry_b->size)
+		return entry_a->size < entry_b->size ? -1 : 1;
+
+	return strcmp(entry_a->name, entry_b->name);
+}
+
+int compare_dir_entries_by_mtime(const void* a, const void* b)
+{
+	const struct dir_entry_t* entry_a = *(const struct dir_entry_t**) a;
+	const struct dir_entry_t* entry_b = *(const struct dir_entry_t**) b;
+
+	if (entry_a->mtime != entry_b->mtime)
+		return entry_a->mtime < entry_b->mtime ? -1 : 1;
+
+	return strcmp(entry_a->name, entry_b->name);
+}
+
+unsigned char dir_entry_type(mode_t mode)
+{
+	if (S_ISDIR(mode)) return DT_DIR;
+	if (S_ISLNK(mode)) return DT_LNK;
+	if (S_ISREG(mode)) return DT_REG;
+
+	return DT_UNKNOWN;
+}
+
+const char* dir_entry_type_as_string(unsigned char type)
+{
+	switch (type) {
+		case DT_DIR:
+			return "dir";
+
+		case DT_LNK:
+			return "link";
+
+		case DT_REG:
+			return "file";
+	}
+
+	return "other";
+}
+
+/* fills in size, mtime and type of an entry */
+void stat_dir_entry(int dir_fd, struct dir_entry_t* entry)
+{
+	struct stat stat_result;
+
+	if (fstatat(dir_fd, entry->name, &stat_result, AT_SYMLINK_NOFOLLOW) != 0)
+		return;
+
+	entry->size = stat_result.st_size;
+	entry->mtime = stat_result.st_mtime;
+	entry->type = dir_entry_type(stat_result.st_mode);
+}
+
+void free_dir_index(struct dir_index_t* index)
+{
+	long i;
+
+	for (i = 0; index->count > i; i++)
+		free(index->entries[i].name);
+
+	free(index->entries);
+	free(index->by_size);
+	free(index->by_mtime);
+	memset(index, 0, sizeof(*index));
+}
+
+/*
+ * re-reads a directory into a new sorted index. every entry is stat()'d again: a name that was
+ * already there may have been replaced by a rename (that's how uploads land), with another size and mtime.
+ */
+int refresh_dir_index(struct dir_index_t* index, const char* directory_path, const struct stat* directory_stat)
+{
+	DIR* dir;
+	struct dirent* entry;
+	struct dir_entry_t* entries = NULL;
+	long count = 0, capacity = 0, i;
+
+	if ((dir = opendir_beneath(directory_path)) == NULL)
+		return -1;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			entries = realloc(entries, capacity * sizeof(*entries));
+		}
+
+		entries[count].name = strdup(entry->d_name);
+		entries[count].size = 0;
+		entries[count].mtime = 0;
+		entries[count].type = entry->d_type;
+		count++;
+	}
+
+	qsort(entries, count, sizeof(*entries), compare_dir_entries_by_name);
+
+	for (i = 0; count > i; i++)
+		stat_dir_entry(dirfd(dir), &entries[i]);
+
+	closedir(dir);
+
+	free_dir_index(index);
+
+	strncpy(index->path, directory_path, PATH_BUFFER_SIZE - 1);
+	index->mtime = directory_stat->st_mtim;
+	index->entries = entries;
+	index->count = count;
+
+	return 0;
+}
+
+/* returns the cached index of a directory, (re)building it when the directory changed since other than through update_dir_index() */
+struct dir_index_t* get_dir_index(const char* directory_path)
+{
+	int i;
+	struct stat directory_stat;
+	struct dir_index_t* index = NULL;
+
+	if (stat_beneath(directory_path, &directory_stat) != 0)
+		return NULL;
+
+	for (i = 0; DIR_INDEX_CACHE_SIZE > i; i++)
+		if (dir_indexes[i].path[0] && strcmp(dir_indexes[i].path, directory_path) == 0)
+			index = &dir_indexes[i];
+
+	if (index == NULL) {
+		/* take the least recently used slot */
+		index = &dir_indexes[0];
+
+		for (i = 1; DIR_INDEX_CACHE_SIZE > i; i++)
+			if (index->last_used > dir_indexes[i].last_used)
+				index = &dir_indexes[i];
+
+		free_dir_index(index);
+	} else if (index->mtime.tv_sec == directory_stat.st_mtim.tv_sec && index->mtime.tv_nsec == directory_stat.st_mtim.tv_nsec) {
+		/* still up to date */
+		index->last_used = ++dir_index_clock;
+		return index;
+	}
+
+	if (refresh_dir_index(index, directory_path, &directory_stat) != 0) {
+		free_dir_index(index);
+		return NULL;
+	}
+
+	index->last_used = ++dir_index_clock;
+
+	return index;
+}
+
+/* the cached index of a directory however its path was spelled ("dir" or "dir/", "" or "." for the root), NULL if there's none */
+struct dir_index_t* find_dir_index(const char* directory_path, size_t length)
+{
+	size_t index_length;
+	int i;
+
+	while (length > 0 && directory_path[length - 1] == '/')
+		length--;
+
+	if (length == 1 && directory_path[0] == '.')
+		length = 0;
+
+	for (i = 0; DIR_INDEX_CACHE_SIZE > i; i++) {
+		if (!dir_indexes[i].path[0])
+			continue;
+
+		for (index_length = strlen(dir_indexes[i].path); index_length > 0 && dir_indexes[i].path[index_length - 1] == '/'; index_length--);
+
+		if (index_length == 1 && dir_indexes[i].path[0] == '.')
+			index_length = 0;
+
+		if (index_length == length && strncmp(dir_indexes[i].path, directory_path, length) == 0)
+			return &dir_indexes[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * to call before this server adds, replaces or removes the entry at path: 1 if the cached index of its
+ * directory is up to date, update_dir_index() then applies the change to it afterwards. otherwise the
+ * directory changed some other way too, and the index is read again when it's next asked for.
+ */
+int is_dir_index_current(const char* path)
+{
+	struct dir_index_t* index;
+	struct stat directory_stat;
+	const char* slash = strrchr(path, '/');
+	int dir_fd;
+
+	if ((index = find_dir_index(path, slash ? (size_t) (slash - path) : 0)) == NULL || (dir_fd = get_parent_dirfd(path, &slash)) < 0 || fstat(dir_fd, &directory_stat) != 0)
+		return 0;
+
+	return index->mtime.tv_sec == directory_stat.st_mtim.tv_sec && index->mtime.tv_nsec == directory_stat.st_mtim.tv_nsec;
+}
+
+/* where entry is, or goes, in an ordering of the index */
+long find_in_dir_ordering(struct dir_entry_t** ordering, long count, struct dir_entry_t* entry, int (*compare)(const void*, const void*))
+{
+	long low = 0, high = count, middle;
+
+	while (high > low) {
+		middle = low + (high - low) / 2;
+
+		if (compare(&ordering[middle], &entry) < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+/*
+ * brings the cached index of path's directory up to date with what this server just did to path (see
+ * is_dir_index_current()): only that entry is stat()'d and moved to its place in the orderings, the
+ * rest of the directory isn't read again
+ */
+void update_dir_index(const char* path, int was_current)
+{
+	struct dir_index_t* index;
+	struct dir_entry_t* entries;
+	struct dir_entry_t*** orderings[2];
+	struct stat directory_stat, stat_result;
+	int (*compares[2])(const void*, const void*) = { compare_dir_entries_by_size, compare_dir_entries_by_mtime };
+	const char* name;
+	char entry_path[PATH_BUFFER_SIZE];
+	long low, high, middle, i, position;
+	int dir_fd, exists, found, j;
+
+	/* extracted directories come with a trailing slash */
+	snprintf(entry_path, sizeof(entry_path), "%s", path);
+
+	while (strlen(entry_path) > 1 && entry_path[strlen(entry_path) - 1] == '/')
+		entry_path[strlen(entry_path) - 1] = '\0';
+
+	name = strrchr(entry_path, '/');
+
+	if (!was_current || (index = find_dir_index(entry_path, name ? (size_t) (name - entry_path) : 0)) == NULL)
+		return;
+
+	if ((dir_fd = get_parent_dirfd(entry_path, &name)) < 0 || fstat(dir_fd, &directory_stat) != 0) {
+		free_dir_index(index);
+		return;
+	}
+
+	exists = fstatat(dir_fd, name, &stat_result, AT_SYMLINK_NOFOLLOW) == 0;
+	orderings[0] = &index->by_size;
+	orderings[1] = &index->by_mtime;
+
+	/* by name */
+	low = 0;
+	high = index->count;
+
+	while (high > low) {
+		middle = low + (high - low) / 2;
+
+		if (strcmp(index->entries[middle].name, name) < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	position = low;
+	found = index->count > position && strcmp(index->entries[position].name, name) == 0;
+
+	/* out of the orderings under its old size and mtime */
+	for (j = 0; found && 2 > j; j++) {
+		if (*orderings[j] == NULL)
+			continue;
+
+		i = find_in_dir_ordering(*orderings[j], index->count, &index->entries[position], compares[j]);
+		memmove(&(*orderings[j])[i], &(*orderings[j])[i + 1], (index->count - i - 1) * sizeof(**orderings[j]));
+	}
+
+	if (found && !exists) {
+		free(index->entries[position].name);
+		memmove(&index->entries[position], &index->entries[position + 1], (index->count - position - 1) * sizeof(*index->entries));
+		index->count--;
+
+		for (j = 0; 2 > j; j++)
+			for (i = 0; *orderings[j] != NULL && index->count > i; i++)
+				if ((*orderings[j])[i] > &index->entries[position])
+					(*orderings[j])[i]--;
+	} else if (!found && exists) {
+		/* a new array, the orderings point into the old one until they are moved over */
+		entries = malloc((index->count + 1) * sizeof(*entries));
+		memcpy(entries, index->entries, position * sizeof(*entries));
+		memcpy(entries + position + 1, index->entries + position, (index->count - position) * sizeof(*entries));
+
+		for (j = 0; 2 > j; j++) {
+			if (*orderings[j] == NULL)
+				continue;
+
+			for (i = 0; index->count > i; i++)
+				(*orderings[j])[i] = entries + ((*orderings[j])[i] - index->entries) + ((*orderings[j])[i] >= index->entries + position);
+
+			*orderings[j] = realloc(*orderings[j], (index->count + 1) * sizeof(**orderings[j]));
+		}
+
+		free(index->entries);
+		index->entries = entries;
+		index->entries[position].name = strdup(name);
+		index->count++;
+	}
+
+	if (exists) {
+		index->entries[position].size = stat_result.st_size;
+		index->entries[position].mtime = stat_result.st_mtime;
+		index->entries[position].type = dir_entry_type(stat_result.st_mode);
+
+		/* back in the orderings under the new ones */
+		for (j = 0; 2 > j; j++) {
+			if (*orderings[j] == NULL)
+				continue;
+
+			i = find_in_dir_ordering(*orderings[j], index->count - 1, &index->entries[position], compares[j]);
+			memmove(&(*orderings[j])[i + 1], &(*orderings[j])[i], (index->count - 1 - i) * sizeof(**orderings[j]));
+			(*orderings[j])[i] = &index->entries[position];
+		}
+	}
+
+	index->mtime = directory_stat.st_mtim;
+}
+
+/* entries in the requested order, NULL when sorted by name (the index's own order) */
+struct dir_entry_t** get_dir_ordering(struct dir_index_t* index, enum listing_sort sort)
+{
+	long i;
+	struct dir_entry_t*** ordering;
+
+	if (sort == S_NAME)
+		return NULL;
+
+	ordering = sort == S_SIZE ? &index->by_size : &index->by_mtime;
+
+	if (*ordering == NULL) {
+		*ordering = malloc(index->count * sizeof(**ordering));
+
+		for (i = 0; index->count > i; i++)
+			(*ordering)[i] = &index->entries[i];
+
+		qsort(*ordering, index->count, sizeof(**ordering), sort == S_SIZE ? compare_dir_entries_by_size : compare_dir_entries_by_mtime);
+	}
+
+	return *ordering;
+}
+
+/* compares an entry against the position a cursor points at */
+int compare_dir_entry_to_cursor(const struct dir_entry_t* entry, enum listing_sort sort, long cursor_key, const char* cursor_name)
+{
+	long key = sort == S_SIZE ? entry->size : entry->mtime;
+
+	if (sort != S_NAME && key != cursor_key)
+		return key < cursor_key ? -1 : 1;
+
+	return strcmp(entry->name, cursor_name);
+}
+
+/*
+ * sends a page of a directory as JSON or NDJSON.
+ * query parameters: format=json|ndjson, sort=name|size|mtime, order=asc|desc, limit=<entries per page>
+ * and cursor=<value of "next" of the previous page>. pages are found by binary search in the cached
+ * index, so page N costs the same as page 1.
+ */
+void send_directory_index_listing(int cfd, struct request_t req, const char* directory_path, int ndjson)
+{
+	struct dir_index_t* index;
+	struct dir_entry_t** ordering;
+	struct dir_entry_t entry;
+	struct dir_entry_t* indexed;
+	struct buffer_t body = { NULL, 0, 0 };
+	struct header_t h_next_cursor = {
+		.name = "X-Next-Cursor"
+	};
+	char value[PATH_BUFFER_SIZE], cursor_name[PATH_BUFFER_SIZE], cursor[PATH_BUFFER_SIZE];
+	char* separator;
+	enum listing_sort sort = S_NAME;
+	int descending = 0, has_cursor, has_next, stale = 0;
+	long limit = LISTING_DEFAULT_LIMIT, cursor_key = 0, low, high, middle, position, sent;
+	int dir_fd;
+
+	/* parameters */
+	if (get_query_param(req, "sort", value, sizeof(value))) {
+		if (strcmp(value, "size") == 0) {
+			sort = S_SIZE;
+		} else if (strcmp(value, "mtime") == 0) {
+			sort = S_MTIME;
+		} else if (strcmp(value, "name") != 0) {
+			send_response_with_content(cfd, "400", "Bad Request", "text/html", "sort must be name, size or mtime");
+			return;
+		}
+	}
+
+	if (get_query_param(req, "order", value, sizeof(value)))
+		descending = strcmp(value, "desc") == 0;
+
+	if (get_query_param(req, "limit", value, sizeof(value)) && (limit = atol(value)) <= 0)
+		limit = LISTING_DEFAULT_LIMIT;
+
+	if (limit > LISTING_MAX_LIMIT)
+		limit = LISTING_MAX_LIMIT;
+
+	/* cursors are "<name>" when sorted by name, "<size or mtime>/<name>" otherwise ('/' can't be in a name) */
+	if ((has_cursor = get_query_param(req, "cursor", cursor_name, sizeof(cursor_name))) && sort != S_NAME) {
+		if ((separator = strchr(cursor_name, '/')) == NULL) {
+			send_response_with_content(cfd, "400", "Bad Request", "text/html", "Malformed cursor");
+			return;
+		}
+
+		cursor_key = atol(cursor_name);
+		memmove(cursor_name, separator + 1, strlen(separator + 1) + 1);
+	}
+
+	if ((index = get_dir_index(directory_path)) == NULL || (dir_fd = get_dirfd(directory_path)) < 0) {
+		send_not_found(cfd);
+		return;
+	}
+
+	ordering = get_dir_ordering(index, sort);
+
+	/* find the first entry past the cursor */
+	low = 0;
+	high = index->count;
+
+	while (has_cursor && high > low) {
+		middle = low + (high - low) / 2;
+
+		if (compare_dir_entry_to_cursor(ordering ? ordering[middle] : &index->entries[middle], sort, cursor_key, cursor_name) < (descending ? 0 : 1)) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	position = descending ? (has_cursor ? low : index->count) - 1 : low;
+
+	if (!ndjson)
+		buffer_printf(&body, "{\"entries\":[");
+
+	for (sent = 0; limit > sent && position >= 0 && index->count > position; sent++, position += descending ? -1 : 1) {
+		indexed = ordering ? ordering[position] : &index->entries[position];
+		entry = *indexed;
+
+		/* the index can be behind on sizes and times (writing to a file doesn't touch its directory), refresh the ones that go out */
+		stat_dir_entry(dir_fd, &entry);
+
+		/* and keep what was found, the orderings are sorted again with it for the next page */
+		if (entry.size != indexed->size || entry.mtime != indexed->mtime) {
+			indexed->size = entry.size;
+			indexed->mtime = entry.mtime;
+			stale = 1;
+		}
+
+		if (sent && !ndjson)
+			buffer_append(&body, ",", 1);
+
+		buffer_printf(&body, "{\"name\":");
+		buffer_append_json_string(&body, entry.name);
+		buffer_printf(&body, ",\"type\":\"%s\",\"size\":%ld,\"mtime\":%ld}", dir_entry_type_as_string(entry.type), entry.size, entry.mtime);
+
+		if (ndjson)
+			buffer_append(&body, "\n", 1);
+	}
+
+	/* cursor to the next page, relative to the last entry sent */
+	has_next = sent > 0 && position >= 0 && index->count > position;
+
+	if (has_next) {
+		entry = ordering ? *ordering[position + (descending ? 1 : -1)] : index->entries[position + (descending ? 1 : -1)];
+
+		if (sort == S_NAME) {
+			snprintf(value, sizeof(value), "%s", entry.name);
+		} else {
+			snprintf(value, sizeof(value), "%ld/%s", sort == S_SIZE ? entry.size : entry.mtime, entry.name);
+		}
+
+		has_next = percent_encode(value, "", cursor, sizeof(cursor)) >= 0;
+		strcpy(h_next_cursor.value, cursor);
+	}
+
+	if (!ndjson)
+		buffer_printf(&body, "],\"next\":%s%s%s}", has_next ? "\"" : "", has_next ? cursor : "null", has_next ? "\"" : "");
+
+	send_response_with_headers(cfd, "200", "OK", ndjson ? "application/x-ndjson" : "application/json", body.length, &h_next_cursor, has_next ? 1 : 0);
+	send(cfd, body.data, body.length, 0);
+	traffic[T_LISTING].bytes += body.length;
+	traffic[T_LISTING].requests++;
+	free(body.data);
+
+	if (stale) {
+		free(index->by_size);
+		free(index->by_mtime);
+		index->by_size = index->by_mtime = NULL;
+	}
+}
+
+void tar_checksum(struct tar_header_t* header)
+{
+	unsigned int sum = 0;
+	size_t i;
+
+	/* the checksum is calculated with its own field set to spaces */
+	memset(header->checksum, ' ', sizeof(header->checksum));
+
+	for (i = 0; sizeof(*header) > i; i++)
+		sum += ((unsigned char*) header)[i];
+
+	snprintf(header->checksum, sizeof(header->checksum), "%06o", sum);
+}
+
+/* appends a "<length> <key>=<value>\n" record of a pax extended header */
+void tar_pax_record(struct buffer_t* records, const char* key, const char* value)
+{
+	size_t length = strlen(key) + strlen(value) + 3, total = length, digits = 0;
+
+	/* the length includes its own digits */
+	do {
+		total = length + ++digits;
+	} while (snprintf(NULL, 0, "%lu", (unsigned long) total) > (int) digits);
+
+	buffer_printf(records, "%lu %s=%s\n", (unsigned long) total, key, value);
+}
+
+/* the send_tar_* functions return 0 on success, -1 once the client is gone */
+int send_tar_data(int cfd, const char* data, size_t length)
+{
+	if (send_all(cfd, data, length) != 0)
+		return -1;
+
+	/* archives count against the read rate limits, headers and padding included */
+	traffic[T_ARCHIVE].bytes += length;
+	charge_buckets(&global_read_bucket, current_client != NULL ? &current_client->read : NULL, length);
+
+	return 0;
+}
+
+int send_tar_padding(int cfd, size_t length)
+{
+	char zeros[TAR_BLOCK_SIZE];
+
+	if (length % TAR_BLOCK_SIZE == 0)
+		return 0;
+
+	memset(zeros, 0, sizeof(zeros));
+	return send_tar_data(cfd, zeros, TAR_BLOCK_SIZE - length % TAR_BLOCK_SIZE);
+}
+
+/*
+ * sends the header block(s) of an entry. names and link targets that don't fit a ustar header
+ * and sizes past 8 GiB go in a pax extended header in front of it.
+ */
+int send_tar_header(int cfd, const char* name, const struct stat* stat_result, char typeflag, const char* linkname)
+{
+	struct tar_header_t header;
+	struct buffer_t records = { NULL, 0, 0 };
+	size_t name_length = strlen(name), split;
+	long size = typeflag == '0' ? stat_result->st_size : 0;
+	char size_value[24];
+	int failed;
+
+	memset(&header, 0, sizeof(header));
+
+	/* short names fit as is, longer ones can be split at a '/' into prefix and name */
+	if (sizeof(header.name) >= name_length) {
+		memcpy(header.name, name, name_length);
+	} else {
+		for (split = name_length - 2; split > 0 && (name[split] != '/' || split > sizeof(header.prefix) || name_length - split - 1 > sizeof(header.name)); split--);
+
+		if (split > 0 && name_length - split - 1 > 0) {
+			memcpy(header.prefix, name, split);
+			memcpy(header.name, name + split + 1, name_length - split - 1);
+		} else {
+			tar_pax_record(&records, "path", name);
+			memcpy(header.name, name, sizeof(header.name));
+		}
+	}
+
+	if (strlen(linkname) > sizeof(header.linkname)) {
+		tar_pax_record(&records, "linkpath", linkname);
+		memcpy(header.linkname, linkname, sizeof(header.linkname));
+	} else {
+		memcpy(header.linkname, linkname, strlen(linkname));
+	}
+
+	if (size > 077777777777L) {
+		snprintf(size_value, sizeof(size_value), "%ld", size);
+		tar_pax_record(&records, "size", size_value);
+	}
+
+	if (records.length > 0) {
+		struct tar_header_t pax_header;
+
+		memset(&pax_header, 0, sizeof(pax_header));
+		strcpy(pax_header.name, "././@PaxHeader");
+		strcpy(pax_header.mode, "0000644");
+		strcpy(pax_header.uid, "0000000");
+		strcpy(pax_header.gid, "0000000");
+		snprintf(pax_header.size, sizeof(pax_header.size), "%011lo", (unsigned long) records.length);
+		strcpy(pax_header.mtime, "00000000000");
+		pax_header.typeflag = 'x';
+		memcpy(pax_header.magic, "ustar", 6);
+		memcpy(pax_header.version, "00", 2);
+		tar_checksum(&pax_header);
+
+		failed = send_tar_data(cfd, (const char*) &pax_header, sizeof(pax_header)) != 0
+			|| send_tar_data(cfd, records.data, records.length) != 0
+			|| send_tar_padding(cfd, records.length) != 0;
+		free(records.data);
+
+		if (failed)
+			return -1;
+	}
+
+	snprintf(header.mode, sizeof(header.mode), "%07o", (unsigned int) (stat_result->st_mode & 07777));
+	snprintf(header.uid, sizeof(header.uid), "%07o", (unsigned int) stat_result->st_uid & 07777777);
+	snprintf(header.gid, sizeof(header.gid), "%07o", (unsigned int) stat_result->st_gid & 07777777);
+	snprintf(header.size, sizeof(header.size), "%011lo", (unsigned long) (size > 077777777777L ? 0 : size));
+	snprintf(header.mtime, sizeof(header.mtime), "%011lo", (unsigned long) stat_result->st_mtime & 077777777777UL);
+	header.typeflag = typeflag;
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+	tar_checksum(&header);
+
+	return send_tar_data(cfd, (const char*) &header, sizeof(header));
+}
+
+/* sends exactly size bytes of a file straight from the page cache, padded to a whole block */
+int send_tar_file_body(int cfd, int fd, long size)
+{
+	char zeros[BUFFER_SIZE];
+	off_t offset = 0;
+	ssize_t sent;
+
+	while (size > offset && (sent = sendfile(cfd, fd, &offset, size - offset)) > 0) {
+		traffic[T_ARCHIVE].bytes += sent;
+		charge_buckets(&global_read_bucket, current_client != NULL ? &current_client->read : NULL, sent);
+	}
+
+	if (size > offset && sent < 0)
+		return -1;
+
+	/* the file shrank while being sent, the header already promised size bytes */
+	if (size > offset) {
+		memset(zeros, 0, sizeof(zeros));
+
+		for (; size > offset; offset += sent)
+			if (send_tar_data(cfd, zeros, sent = size - offset > BUFFER_SIZE ? BUFFER_SIZE : size - offset) != 0)
+				return -1;
+	}
+
+	return send_tar_padding(cfd, size);
+}
+
+/*
+ * streams the entries of a directory, and recursively its subdirectories, as tar. takes over dir_fd.
+ * skip is an entry of this directory left out (NULL for none). stops at the first failed send
+ */
+int send_tar_directory(int cfd, int dir_fd, const char* archive_path, int depth, const char* skip)
+{
+	DIR* dir;
+	struct dirent* entry;
+	struct stat stat_result;
+	char entry_archive_path[PATH_BUFFER_SIZE * 2], linkname[PATH_BUFFER_SIZE];
+	ssize_t linkname_length;
+	int fd, failed = 0;
+
+	if (depth > TAR_MAX_DEPTH || (dir = fdopendir(dir_fd)) == NULL) {
+		close(dir_fd);
+		return 0;
+	}
+
+	while (!failed && (entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || (skip != NULL && strcmp(entry->d_name, skip) == 0))
+			continue;
+
+		snprintf(entry_archive_path, sizeof(entry_archive_path), "%s/%s", archive_path, entry->d_name);
+
+		/* links are archived as links, not followed */
+		if (fstatat(dirfd(dir), entry->d_name, &stat_result, AT_SYMLINK_NOFOLLOW) != 0)
+			continue;
+
+		if (S_ISDIR(stat_result.st_mode)) {
+			if ((fd = openat_beneath(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0)) < 0)
+				continue;
+
+			strcat(entry_archive_path, "/");
+
+			if (send_tar_header(cfd, entry_archive_path, &stat_result, '5', "") != 0) {
+				close(fd);
+				failed = 1;
+				break;
+			}
+
+			entry_archive_path[strlen(entry_archive_path) - 1] = '\0';
+			failed = send_tar_directory(cfd, fd, entry_archive_path, depth + 1, NULL) != 0;
+		} else if (S_ISREG(stat_result.st_mode)) {
+			/* files that can't be opened are left out rather than sent empty */
+			if ((fd = openat_beneath(dirfd(dir), entry->d_name, O_RDONLY | O_NOFOLLOW, 0)) < 0)
+				continue;
+
+			failed = send_tar_header(cfd, entry_archive_path, &stat_result, '0', "") != 0
+				|| send_tar_file_body(cfd, fd, stat_result.st_size) != 0;
+			close(fd);
+		} else if (S_ISLNK(stat_result.st_mode)) {
+			if ((linkname_length = readlinkat(dirfd(dir), entry->d_name, linkname, sizeof(linkname) - 1)) < 0)
+				continue;
+
+			linkname[linkname_length] = '\0';
+			failed = send_tar_header(cfd, entry_archive_path, &stat_result, '2', linkname) != 0;
+		}
+	}
+
+	closedir(dir);
+	return failed ? -1 : 0;
+}
+
+/*
+ * streams a directory tree as a tar archive (GET /some/dir/?archive=tar).
+ * headers are built in memory and file bodies go out with sendfile(), nothing is staged on disk
+ * and memory use doesn't depend on the size of the tree. the length isn't known up front,
+ * the end of the archive is the end of the connection.
+ */
+void send_directory_archive(int cfd, const char* directory_path)
+{
+	struct stat stat_result;
+	char archive_path[PATH_BUFFER_SIZE];
+	char zeros[TAR_BLOCK_SIZE * 2];
+	const char* base;
+	size_t length = strlen(directory_path);
+	int dir_fd;
+	struct header_t h_content_disposition = {
+		.name = "Content-Disposition"
+	};
+
+	if ((dir_fd = open_beneath(directory_path, O_RDONLY | O_DIRECTORY, 0)) < 0 || fstat(dir_fd, &stat_result) != 0) {
+		if (dir_fd >= 0) close(dir_fd);
+		send_not_found(cfd);
+		return;
+	}
+
+	/* everything goes in a directory named after the one requested */
+	while (length > 1 && directory_path[length - 1] == '/')
+		length--;
+
+	for (base = directory_path + length; base > directory_path && base[-1] != '/'; base--);
+
+	snprintf(archive_path, sizeof(archive_path), "%.*s", (int) (directory_path + length - base), base);
+
+	if (archive_path[0] == '\0' || strcmp(archive_path, ".") == 0)
+		strcpy(archive_path, "root");
+
+	if (refuse_over_limit(cfd, &global_read_bucket, current_client != NULL ? &current_client->read : NULL)) {
+		close(dir_fd);
+		return;
+	}
+
+	snprintf(h_content_disposition.value, HEADER_VALUE_SIZE, "attachment; filename=\"%s.tar\"", archive_path);
+	send_response_with_headers(cfd, "200", "OK", "application/x-tar", -1, &h_content_disposition, 1);
+	traffic[T_ARCHIVE].requests++;
+
+	/* a client that goes away ends the walk, the rest of the tree isn't read for nothing */
+	strcat(archive_path, "/");
+
+	if (send_tar_header(cfd, archive_path, &stat_result, '5', "") != 0) {
+		close(dir_fd);
+		return;
+	}
+
+	archive_path[strlen(archive_path) - 1] = '\0';
+
+	/* the server's own files aren't part of the tree */
+	if (send_tar_directory(cfd, dir_fd, archive_path, 0, is_root_directory(&stat_result) ? RESERVED_PATH : NULL) != 0)
+		return;
+
+	/* end of archive */
+	memset(zeros, 0, sizeof(zeros));
+	send_tar_data(cfd, zeros, sizeof(zeros));
+}
+
+/* bandwidth used per class of traffic, for GET /.micro/stats (local clients only) */
+void send_stats(int cfd)
+{
+	struct buffer_t body = { NULL, 0, 0 };
+	int i;
+
+	buffer_printf(&body, "{\"classes\":{");
+
+	for (i = 0; TRAFFIC_CLASS_COUNT > i; i++)
+		buffer_printf(&body, "%s\"%s\":{\"bytes\":%lu,\"requests\":%lu}", i ? "," : "", TRAFFIC_CLASS_NAMES[i], traffic[i].bytes, traffic[i].requests);
+
+	buffer_printf(&body, "},\"active_transfers\":%d,\"limits\":{\"global_read\":%.0f,\"global_upload\":%.0f,\"client_read\":%.0f,\"client_upload\":%.0f}}\n", transfer_count, global_read_bucket.rate, global_upload_bucket.rate, client_read_rate, client_upload_rate);
+
+	send_response_with_content_length(cfd, "200", "OK", "application/json", body.length);
+	send(cfd, body.data, body.length, 0);
+	free(body.data);
+}
+
+/* the slow requests in the trace ring as NDJSON, oldest first, for GET /.micro/trace (local clients only) */
+void send_traces(int cfd)
+{
+	struct buffer_t body = { NULL, 0, 0 };
+	const struct trace_t* trace;
+	int i, phase, count;
+
+	for (i = 0; trace_ring_count > i; i++) {
+		trace = &trace_ring[(trace_ring_next - trace_ring_count + i + TRACE_RING_SIZE) % TRACE_RING_SIZE];
+
+		buffer_printf(&body, "{\"time\":%ld,\"client\":\"%s\",\"method\":\"%s\",\"path\":", (long) trace->time, trace->client, trace->method != NULL ? trace->method : "");
+		buffer_append_json_string(&body, trace->path);
+		buffer_printf(&body, ",\"status\":%d,\"total_ms\":%.3f,\"phases\":{", trace->status, trace->total * 1000);
+
+		for (phase = 0, count = 0; PHASE_COUNT > phase; phase++)
+			if (trace->seen[phase])
+				buffer_printf(&body, "%s\"%s\":%.3f", count++ ? "," : "", PHASE_NAMES[phase], trace->phases[phase] * 1000);
+
+		buffer_append(&body, "}}\n", 3);
+	}
+
+	send_response_with_content_length(cfd, "200", "OK", "application/x-ndjson", body.length);
+	send(cfd, body.data, body.length, 0);
+	free(body.data);
+}
+
+void handle_get_request(int cfd, struct request_t req)
+{
+	/* result of stat */
+	struct stat stat_result;
+	char format[8];
+	int exists;
+	double started;
+	const char* path = relative_path(req.path);
+
+	if (strcmp(req.path, STATS_PATH) == 0 && current_client_is_local) {
+		send_stats(cfd);
+		return;
+	}
+
+	if (strcmp(req.path, TRACE_PATH) == 0 && current_client_is_local) {
+		send_traces(cfd);
+		return;
+	}
+
+	/* the stored copies of -d outlive the files (and the authentication) they were uploaded with */
+	if (is_reserved_path(path)) {
+		send_not_found(cfd);
+		return;
+	}
+
+	started = phase_start(P_STAT);
+	exists = stat_beneath(path, &stat_result) == 0;
+	phase_end(&current_trace, P_STAT, started);
+
+	if (exists) {
+		/* exists */
+		if (S_ISREG(stat_result.st_mode) || S_ISLNK(stat_result.st_mode)) {
+			/* send file over http */
+			send_http_file(cfd, &req, path);
+		} else if (S_ISDIR(stat_result.st_mode)) {
+			started = phase_start(P_SEND);
+
+			/* list directory over http */
+			if (get_query_param(req, "archive", format, sizeof(format))) {
+				if (strcmp(format, "tar") == 0) {
+					send_directory_archive(cfd, path);
+				} else {
+					send_response_with_content(cfd, "400", "Bad Request", "text/html", "archive must be tar");
+				}
+			} else if (!get_query_param(req, "format", format, sizeof(format)) || strcmp(format, "html") == 0) {
+				send_directory_listing(cfd, path);
+			} else if (strcmp(format, "json") == 0 || strcmp(format, "ndjson") == 0) {
+				send_directory_index_listing(cfd, req, path, strcmp(format, "ndjson") == 0);
+			} else {
+				send_response_with_content(cfd, "400", "Bad Request", "text/html", "format must be html, json or ndjson");
+			}
+
+			phase_end(&current_trace, P_SEND, started);
+		}
+	} else {
+		/* file does not exit */
+		send_not_found(cfd);
+	}
+}
+
+/*
+ * connects to a peer, giving up after PEER_TIMEOUT. sends and receives time out after PEER_TIMEOUT too,
+ * answers are only read once poll() in the main loop says they're there
+ */
+int connect_peer(const struct peer_t* peer)
+{
+	int fd, error = 0;
+	socklen_t error_length = sizeof(error);
+	struct pollfd poll_fd;
+	struct timeval timeout = { PEER_TIMEOUT, 0 };
+
+	if ((fd = socket(peer->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		return -1;
+
+	if (connect(fd, (const struct sockaddr*) &peer->address, peer->address_length) != 0) {
+		poll_fd.fd = fd;
+		poll_fd.events = POLLOUT;
+
+		if (errno != EINPROGRESS || poll(&poll_fd, 1, PEER_TIMEOUT * 1000) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0 || error != 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (void*) &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void*) &timeout, sizeof(timeout));
+
+	return fd;
+}
+
+/* request line and headers of a mutation sent to a peer, content_length < 0 for none */
+int send_peer_request(int fd, const struct peer_t* peer, const char* method, const char* path, const char* query, long content_length, const struct header_t* headers, int header_count)
+{
+	struct buffer_t request = { NULL, 0, 0 };
+	char encoded_path[PATH_BUFFER_SIZE * 3];
+	int i, result;
+
+	if (percent_encode(path, "/", encoded_path, sizeof(encoded_path)) < 0)
+		return -1;
+
+	buffer_printf(&request, "%s %s%s%s HTTP/1.1\r\nHost: %s\r\n"REPLICA_HEADER": %s\r\n", method, encoded_path, query[0] ? "?" : "", query, peer->spec, replica_key ? replica_key : "1");
+
+	if (content_length >= 0)
+		buffer_printf(&request, "Content-Length: %ld\r\n", content_length);
+
+	for (i = 0; header_count > i; i++)
+		buffer_printf(&request, "%s: %s\r\n", headers[i].name, headers[i].value);
+
+	buffer_append(&request, "\r\n", 2);
+	result = send_all(fd, request.data, request.length);
+	free(request.data);
+
+	return result;
+}
+
+/* status code of a peer's answer, -1 if there's none. only the status line matters, the rest goes with the connection */
+int recv_peer_status(int fd)
+{
+	char buffer[BUFFER_SIZE];
+	size_t length = 0;
+	ssize_t read_length;
+	int status;
+
+	while (sizeof(buffer) - 1 > length && memchr(buffer, '\n', length) == NULL && (read_length = recv(fd, buffer + length, sizeof(buffer) - 1 - length, 0)) > 0)
+		length += read_length;
+
+	buffer[length] = '\0';
+
+	if (sscanf(buffer, "HTTP/%*d.%*d %d", &status) != 1)
+		return -1;
+
+	return status;
+}
+
+/*
+ * starts replicating the mutation in req to the peers: each one that's up gets the request line and the
+ * headers that matter right away, the body follows piece by piece as it's received (recv_body). call
+ * finish_replication() once the body is in. peers that are down are left out, they get caught up later.
+ */
+void replicate_request(struct request_t* req, long content_length)
+{
+	const char* FORWARDED[] = { "Authorization", "Content-Range", "Digest" };
+	struct header_t headers[sizeof(FORWARDED) / sizeof(FORWARDED[0])];
+	int i, header_index, header_count = 0;
+	double now = monotonic_now();
+
+	if (peer_count == 0 || get_header_index(*req, REPLICA_HEADER) != -1)
+		return;
+
+	for (i = 0; (int) (sizeof(FORWARDED) / sizeof(FORWARDED[0])) > i; i++)
+		if ((header_index = get_header_index(*req, FORWARDED[i])) != -1)
+			headers[header_count++] = req->headers[header_index];
+
+	replicating = 1;
+
+	for (i = 0; peer_count > i; i++) {
+		if (peers[i].retry_at > now)
+			continue;
+
+		if ((peers[i].fd = connect_peer(&peers[i])) < 0) {
+			mark_peer_down(&peers[i]);
+		} else if (send_peer_request(peers[i].fd, &peers[i], method_as_string(req->method), req->path, req->query, content_length, headers, header_count) != 0) {
+			close(peers[i].fd);
+			peers[i].fd = -1;
+			mark_peer_down(&peers[i]);
+		}
+	}
+}
+
+/* stops waiting for the answer to a catch up request, a new one is sent for the entry later (or it's done with) */
+void end_catch_up_request(struct catch_up_t* entry)
+{
+	if (entry->fd < 0)
+		return;
+
+	if (entry->file_fd >= 0)
+		close(entry->file_fd);
+
+	close(entry->fd);
+	entry->fd = -1;
+	entry->file_fd = -1;
+	peers[entry->peer].in_flight--;
+	catch_up_in_flight--;
+}
+
+void queue_catch_up(int peer, const char* path, const char* authorization)
+{
+	struct catch_up_t* entry;
+	int i;
+
+	/* one entry per path is enough, it's the state the path has by then that is sent */
+	for (i = 0; catch_up_count > i; i++) {
+		entry = &catch_up[(catch_up_head + i) % CATCH_UP_SIZE];
+
+		if (entry->used && entry->peer == peer && strcmp(entry->path, path) == 0) {
+			snprintf(entry->authorization, sizeof(entry->authorization), "%s", authorization);
+
+			/* a request in flight has the state from before, the new one is sent instead */
+			end_catch_up_request(entry);
+			return;
+		}
+	}
+
+	if (catch_up_count == CATCH_UP_SIZE) {
+		entry = &catch_up[catch_up_head];
+
+		if (entry->used) {
+			fprintf(stderr, SERVER_NAME": warn: catch up queue full, %s on peer %s is left out of date\n", entry->path, peers[entry->peer].spec);
+			end_catch_up_request(entry);
+			peers[entry->peer].pending--;
+		}
+
+		catch_up_head = (catch_up_head + 1) % CATCH_UP_SIZE;
+		catch_up_count--;
+	}
+
+	entry = &catch_up[(catch_up_head + catch_up_count++) % CATCH_UP_SIZE];
+	entry->peer = peer;
+	entry->used = 1;
+	entry->fd = -1;
+	entry->file_fd = -1;
+	snprintf(entry->path, sizeof(entry->path), "%s", path);
+	snprintf(entry->authorization, sizeof(entry->authorization), "%s", authorization);
+	peers[peer].pending++;
+}
+
+/* counts a peer's answer to a replicated mutation (-1 when there's none), queues it for catch up if its outcome differs from the one here */
+void take_peer_answer(struct replication_t* replication, int peer, int status)
+{
+	const char* path;
+	int took = replication->expected_status ? status == replication->expected_status : status / 100 == 2;
+
+	/* gone there already is as good as deleted */
+	if (replication->deleting && status == 404)
+		took = 1;
+
+	replication->taken_by += took;
+
+	if (took == !replication->failed_here)
+		return;
+
+	for (path = replication->paths.data; replication->paths.data + replication->paths.length > path; path += strlen(path) + 1)
+		queue_catch_up(peer, path, replication->authorization);
+}
+
+/*
+ * the body is in: the peers' connections are handed to the main loop, which waits for their answers
+ * (run_replications()), nothing here waits for a peer. expected_status is the answer that counts as taken,
+ * 0 for any 2xx. the paths it touched (each ending in a \0) are queued for catch up on every peer whose
+ * outcome differs from the one here, failed_here tells how it went here. the client's response goes
+ * through reply_replicated().
+ */
+void finish_replication(struct request_t* req, const char* paths, size_t paths_length, int expected_status, int failed_here)
+{
+	static struct replication_t unwaited;
+	struct replication_t* replication = NULL;
+	int i, header_index;
+
+	current_replication = NULL;
+
+	if (!replicating)
+		return;
+
+	replicating = 0;
+
+	for (i = 0; MAX_REPLICATIONS > i && replication == NULL; i++)
+		if (!replications[i].active)
+			replication = &replications[i];
+
+	/* too many waited for already, the peers that got it are caught up on it instead */
+	if (replication == NULL)
+		replication = &unwaited;
+
+	header_index = get_header_index(*req, "Authorization");
+	snprintf(replication->authorization, sizeof(replication->authorization), "%s", header_index != -1 ? req->headers[header_index].value : "");
+	replication->deadline = monotonic_now() + PEER_ANSWER_TIMEOUT;
+	replication->expected_status = expected_status;
+	replication->failed_here = failed_here;
+	replication->deleting = req->method == M_DELETE;
+	replication->taken_by = 0;
+	replication->cfd = -1;
+	buffer_append(&replication->paths, paths, paths_length);
+
+	for (i = 0; peer_count > i; i++) {
+		replication->fds[i] = peers[i].fd;
+		peers[i].fd = -1;
+
+		/* whatever didn't arrive isn't coming, no peer waits for the rest of a body cut short */
+		if (replication->fds[i] >= 0)
+			shutdown(replication->fds[i], SHUT_WR);
+
+		if (replication->fds[i] >= 0 && replication != &unwaited)
+			continue;
+
+		if (replication->fds[i] >= 0) {
+			close(replication->fds[i]);
+			replication->fds[i] = -1;
+		}
+
+		/* down, or not waited for */
+		take_peer_answer(replication, i, -1);
+	}
+
+	if (replication != &unwaited) {
+		replication->active = 1;
+		replication_count++;
+	}
+
+	current_replication = replication;
+}
+
+/* 1 once enough peers took the mutation for -a, 0 when they can't anymore, -1 while that depends on the answers still owed */
+int replication_outcome(const struct replication_t* replication)
+{
+	int i, owed = 0, needed = ack_policy == A_QUORUM ? (peer_count + 1) / 2 : ack_policy == A_ALL ? peer_count : 0;
+
+	if (replication->taken_by >= needed)
+		return 1;
+
+	for (i = 0; peer_count > i; i++)
+		owed += replication->fds[i] >= 0;
+
+	return replication->taken_by + owed >= needed ? -1 : 0;
+}
+
+void send_reply(int cfd, const struct reply_t* reply)
+{
+	if (reply->content_type == NULL) {
+		send_response_basic(cfd, reply->status_code, reply->status_text);
+		return;
+	}
+
+	send_response_with_content_length(cfd, reply->status_code, reply->status_text, reply->content_type, reply->length);
+	send_all(cfd, reply->body, reply->length);
+}
+
+/* copies the body of a reply that is held, so it outlives the request handler */
+void hold_reply(struct reply_t* held, const struct reply_t* reply)
+{
+	char* body = NULL;
+
+	if (reply->length > 0) {
+		body = malloc(reply->length);
+		memcpy(body, reply->body, reply->length);
+	}
+
+	*held = *reply;
+	held->body = body;
+}
+
+/*
+ * responds to a mutation that went well here: taken once it's on enough peers for -a, not_taken when it can't be.
+ * if the peers' answers are still needed to tell, the client is held and the main loop responds.
+ */
+void reply_replicated(int cfd, const struct reply_t* taken, const struct reply_t* not_taken)
+{
+	struct replication_t* replication = current_replication;
+	int outcome = replication != NULL ? replication_outcome(replication) : 1;
+
+	if (outcome >= 0) {
+		send_reply(cfd, outcome ? taken : not_taken);
+		return;
+	}
+
+	replication->cfd = cfd;
+	hold_reply(&replication->taken, taken);
+	hold_reply(&replication->not_taken, not_taken);
+	replication->trace = current_trace;
+	connection_kept = 1;
+}
+
+/* responds to a held client once its answer is known, and lets the replication go once nothing is owed anymore */
+void settle_replication(struct replication_t* replication)
+{
+	int i, outcome;
+
+	if (replication->cfd >= 0 && (outcome = replication_outcome(replication)) >= 0) {
+		current_trace = replication->trace;
+		send_reply(replication->cfd, outcome ? &replication->taken : &replication->not_taken);
+		trace_done(&current_trace);
+		close(replication->cfd);
+		replication->cfd = -1;
+		free((char*) replication->taken.body);
+		free((char*) replication->not_taken.body);
+	}
+
+	for (i = 0; peer_count > i; i++)
+		if (replication->fds[i] >= 0)
+			return;
+
+	if (replication->cfd >= 0)
+		return;
+
+	free(replication->paths.data);
+	replication->paths.data = NULL;
+	replication->paths.length = replication->paths.capacity = 0;
+
+	if (replication->active) {
+		replication->active = 0;
+		replication_count--;
+	}
+}
+
+/* reads the answers of the peers that have one (poll_index tells where each connection is in poll_fds), and gives up on those past the deadline */
+void run_replications(struct pollfd* poll_fds, int poll_index[MAX_REPLICATIONS][MAX_PEERS])
+{
+	struct replication_t* replication;
+	double now = monotonic_now();
+	int i, j, status, answered;
+
+	for (j = 0; MAX_REPLICATIONS > j; j++) {
+		replication = &replications[j];
+
+		if (!replication->active)
+			continue;
+
+		for (i = 0; peer_count > i; i++) {
+			if (replication->fds[i] < 0)
+				continue;
+
+			answered = poll_index[j][i] >= 0 && poll_fds[poll_index[j][i]].revents & (POLLIN | POLLERR | POLLHUP);
+
+			if (!answered && replication->deadline > now)
+				continue;
+
+			status = answered ? recv_peer_status(replication->fds[i]) : -1;
+			close(replication->fds[i]);
+			replication->fds[i] = -1;
+
+			if (status < 0) {
+				mark_peer_down(&peers[i]);
+			} else {
+				mark_peer_up(&peers[i]);
+			}
+
+			take_peer_answer(replication, i, status);
+		}
+
+		settle_replication(replication);
+	}
+}
+
+/*
+ * sends a peer the state path has here: PUT of the file, or DELETE when there's none. only the request line and
+ * headers go out here, run_catch_up() sends the file's body as the connection takes it and then reads the answer.
+ * returns 0 once started, 1 when there's nothing to send and -1 if the peer can't be reached
+ */
+int send_catch_up(struct peer_t* peer, struct catch_up_t* entry)
+{
+	struct header_t authorization;
+	struct stat stat_result;
+	int fd, peer_fd, failed;
+
+	strcpy(authorization.name, "Authorization");
+	snprintf(authorization.value, sizeof(authorization.value), "%s", entry->authorization);
+
+	if ((fd = open_beneath(entry->path, O_RDONLY, 0)) >= 0 && (fstat(fd, &stat_result) != 0 || !S_ISREG(stat_result.st_mode))) {
+		/* directories come with the files in them */
+		close(fd);
+		return 1;
+	}
+
+	if ((peer_fd = connect_peer(peer)) < 0) {
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+
+	entry->deleting = fd < 0;
+
+	if (fd < 0)
+		failed = send_peer_request(peer_fd, peer, "DELETE", entry->path, "", -1, &authorization, entry->authorization[0] ? 1 : 0) != 0;
+	else
+		failed = send_peer_request(peer_fd, peer, "PUT", entry->path, "", stat_result.st_size, &authorization, entry->authorization[0] ? 1 : 0) != 0;
+
+	if (failed) {
+		if (fd >= 0) close(fd);
+		close(peer_fd);
+		return -1;
+	}
+
+	entry->fd = peer_fd;
+	entry->file_fd = -1;
+	entry->deadline = monotonic_now() + PEER_ANSWER_TIMEOUT;
+
+	if (fd >= 0 && stat_result.st_size > 0) {
+		/* the body is written to when it can take it, a slow peer mustn't hold the main loop */
+		fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL) | O_NONBLOCK);
+		entry->file_fd = fd;
+		entry->offset = 0;
+		entry->end = stat_result.st_size;
+		entry->deadline = monotonic_now() + PEER_TIMEOUT;
+	} else if (fd >= 0) {
+		close(fd);
+	}
+
+	peer->in_flight++;
+	catch_up_in_flight++;
+
+	return 0;
+}
+
+/* seconds until the main loop has something to do for catch up (a peer to retry, an answer to give up on), -1 if there's nothing */
+double next_catch_up(double now)
+{
+	double next = -1;
+	int i;
+
+	for (i = 0; peer_count > i && CATCH_UP_BATCH > catch_up_in_flight; i++)
+		if (peers[i].pending > peers[i].in_flight && (next < 0 || next > peers[i].retry_at - now))
+			next = peers[i].retry_at > now ? peers[i].retry_at - now : 0;
+
+	for (i = 0; catch_up_count > i && catch_up_in_flight > 0; i++)
+		if (catch_up[(catch_up_head + i) % CATCH_UP_SIZE].fd >= 0 && (next < 0 || next > catch_up[(catch_up_head + i) % CATCH_UP_SIZE].deadline - now))
+			next = catch_up[(catch_up_head + i) % CATCH_UP_SIZE].deadline > now ? catch_up[(catch_up_head + i) % CATCH_UP_SIZE].deadline - now : 0;
+
+	return next;
+}
+
+/* sends a quantum of a catch up request's body, returns -1 if the peer stopped taking it */
+int send_catch_up_body(struct catch_up_t* entry, double now)
+{
+	ssize_t sent;
+
+	if ((sent = sendfile(entry->fd, entry->file_fd, &entry->offset, entry->end - entry->offset > SEND_QUANTUM ? SEND_QUANTUM : entry->end - entry->offset)) < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	if (sent == 0)
+		return -1;
+
+	entry->deadline = now + PEER_TIMEOUT;
+
+	if (entry->end > entry->offset)
+		return 0;
+
+	/* all out, now it's the answer that's waited for */
+	close(entry->file_fd);
+	entry->file_fd = -1;
+	entry->deadline = now + PEER_ANSWER_TIMEOUT;
+	fcntl(entry->fd, F_SETFL, fcntl(entry->fd, F_GETFL) & ~O_NONBLOCK);
+
+	return 0;
+}
+
+/*
+ * brings peers that are back up to date: sends the bodies a quantum per round and reads the answers that are
+ * there (poll_index tells where each entry's connection is in poll_fds), then starts more, up to CATCH_UP_BATCH in flight
+ */
+void run_catch_up(struct pollfd* poll_fds, int poll_index[CATCH_UP_SIZE])
+{
+	struct catch_up_t* entry;
+	struct peer_t* peer;
+	int i, slot, status, answered;
+	double now = monotonic_now();
+
+	for (i = 0; catch_up_count > i && catch_up_in_flight > 0; i++) {
+		slot = (catch_up_head + i) % CATCH_UP_SIZE;
+		entry = &catch_up[slot];
+		peer = &peers[entry->peer];
+
+		if (!entry->used || entry->fd < 0)
+			continue;
+
+		if (entry->file_fd >= 0) {
+			if (poll_index[slot] >= 0 && poll_fds[poll_index[slot]].revents & (POLLOUT | POLLERR | POLLHUP) && send_catch_up_body(entry, now) < 0) {
+				end_catch_up_request(entry);
+				mark_peer_down(peer);
+			} else if (entry->file_fd >= 0 && now >= entry->deadline) {
+				end_catch_up_request(entry);
+				mark_peer_down(peer);
+			}
+
+			continue;
+		}
+
+		answered = poll_index[slot] >= 0 && poll_fds[poll_index[slot]].revents & (POLLIN | POLLERR | POLLHUP);
+
+		if (!answered && entry->deadline > now)
+			continue;
+
+		status = answered ? recv_peer_status(entry->fd) : -1;
+		end_catch_up_request(entry);
+
+		if (status < 0) {
+			mark_peer_down(peer);
+			continue;
+		}
+
+		/* gone there already is as good as deleted */
+		if (entry->deleting && status == 404)
+			status = 204;
+
+		/* it answered, it's up: retrying a path it refuses would only get the same answer */
+		if (status / 100 != 2)
+			fprintf(stderr, SERVER_NAME": warn: peer %s refused catching up on %s (%d), it stays out of date\n", peer->spec, entry->path, status);
+
+		if (peer->retry_interval != 0)
+			fprintf(stderr, SERVER_NAME": peer %s is back up\n", peer->spec);
+
+		mark_peer_up(peer);
+		entry->used = 0;
+		peer->pending--;
+	}
+
+	for (i = 0; catch_up_count > i && CATCH_UP_BATCH > catch_up_in_flight; i++) {
+		entry = &catch_up[(catch_up_head + i) % CATCH_UP_SIZE];
+		peer = &peers[entry->peer];
+
+		if (!entry->used || entry->fd >= 0 || peer->retry_at > now)
+			continue;
+
+		if ((status = send_catch_up(peer, entry)) < 0) {
+			mark_peer_down(peer);
+		} else if (status == 1) {
+			entry->used = 0;
+			peer->pending--;
+		}
+	}
+
+	while (catch_up_count > 0 && !catch_up[catch_up_head].used) {
+		catch_up_head = (catch_up_head + 1) % CATCH_UP_SIZE;
+		catch_up_count--;
+	}
+}
+
+/* marks the segments in [first, last) as received, returns 1 once every segment has arrived, 0 if some are still missing and -1 on error */
+int mark_upload_segments(int map_fd, long first, long last, struct upload_map_t* map)
+{
+	long segment, count, offset;
+	unsigned char byte;
+
+	if (pread(map_fd, map, sizeof(*map), 0) != sizeof(*map))
+		return -1;
 
-	for (i = 0; len > i; i += 4) {
-		byte_1 = FROM_BASE64[(unsigned int) str[i]];
-		byte_2 = FROM_BASE64[(unsigned int) str[i + 1]];
-		byte_3 = FROM_BASE64[(unsigned int) str[i + 2]];
-		byte_4 = FROM_BASE64[(unsigned int) str[i + 3]];
+	count = (map->total + map->segment_size - 1) / map->segment_size;
 
-		if (str[i + 3] == '=') {	
-			if (str[i + 2] == '=') {
-				out_str[counter++] = byte_1 << 2 | ((byte_2 & 0xf0) >> 4);
-			} else {
-				out_str[counter++] = byte_1 << 2 | ((byte_2 & 0xf0) >> 4);
-				out_str[counter++] = ((byte_2 & 0x0f) << 4) | ((byte_3 & 0x3c) >> 2);
-			}
+	for (segment = first; last > segment; segment++) {
+		offset = sizeof(*map) + segment / 8;
+
+		if (pread(map_fd, &byte, 1, offset) != 1)
+			return -1;
+
+		/* segments can be sent more than once (retries, resumes), only count them once */
+		if (byte & (1 << (segment % 8)))
+			continue;
+
+		byte |= 1 << (segment % 8);
+		map->received++;
+
+		if (pwrite(map_fd, &byte, 1, offset) != 1)
+			return -1;
+	}
+
+	if (pwrite(map_fd, map, sizeof(*map), 0) != sizeof(*map))
+		return -1;
+
+	return map->received >= count ? 1 : 0;
+}
+
+/*
+ * PUT with a Content-Range header, one or more 1 MiB segments of a bigger file (ranges are aligned to them).
+ * Segments can arrive in any order and over any number of connections: the data is
+ * pwrite()'d at its offset into a .part file and the segments that fully arrived are
+ * tracked in a bitmap in a .part.map (locked with flock, so it also works with several
+ * server processes on the same port), both in UPLOADS_PATH. Once the last segment is in,
+ * the part file is renamed over <path>. Re-sending a segment that was cut off resumes the upload.
+ */
+void handle_put_range_request(int cfd, struct request_t* req, long content_length, const char* content_range)
+{
+	int read_length, fd, map_fd, complete, index_current;
+	long first, last, total, count, offset, written = 0, first_segment, last_segment;
+	char buffer[BUFFER_SIZE];
+	struct reply_t created = { "201", "Created", NULL, NULL, 0 }, accepted = { "202", "Accepted", "text/plain", buffer, 0 };
+	struct reply_t unreplicated = { "503", "Service Unavailable", "text/html", NOT_REPLICATED, sizeof(NOT_REPLICATED) - 1 };
+	char part_path[UPLOAD_PATH_SIZE], map_path[UPLOAD_PATH_SIZE];
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	struct upload_map_t map;
+	struct stat stat_result;
+	struct statvfs fs;
+	const char* path = relative_path(req->path);
+
+	if (sscanf(content_range, "bytes %ld-%ld/%ld", &first, &last, &total) != 3) {
+		send_response_with_content(cfd, "400", "Bad Request", "text/html", "Expected Content-Range: bytes first-last/total");
+		return;
+	}
+
+	if (first < 0 || first > last || last >= total) {
+		send_response_basic(cfd, "416", "Range Not Satisfiable");
+		return;
+	}
+
+	if (content_length != last - first + 1) {
+		send_response_with_content(cfd, "400", "Bad Request", "text/html", "Content-Length does not match Content-Range");
+		return;
+	}
+
+	/* only whole segments are tracked, a range has to start and end on their boundaries (or at the end of the file) */
+	if (first % UPLOAD_SEGMENT_SIZE != 0 || ((last + 1) % UPLOAD_SEGMENT_SIZE != 0 && last + 1 != total)) {
+		send_response_with_content(cfd, "400", "Bad Request", "text/html", "Content-Range must be aligned to 1 MiB segments");
+		return;
+	}
+
+	get_upload_paths(path, part_path, map_path);
+	index_current = is_dir_index_current(path);
+
+	/* kept in the server's own directory until complete, made when the first segmented upload comes */
+	if ((mkdir_beneath(RESERVED_PATH, 0755) != 0 && errno != EEXIST) || (mkdir_beneath(UPLOADS_PATH, 0700) != 0 && errno != EEXIST) || (map_fd = open_beneath(map_path, O_RDWR | O_CREAT, 0666)) == -1) {
+		send_response_with_content(cfd, "500", "Internal Server Error", "text/html", "Can't open upload map");
+		return;
+	}
+
+	if ((fd = open_beneath(part_path, O_RDWR | O_CREAT, 0666)) == -1) {
+		send_response_with_content(cfd, "500", "Internal Server Error", "text/html", "Can't open file");
+		close(map_fd);
+		return;
+	}
+
+	/* the first segment to arrive sets the upload up, the others check they belong to the same one */
+	flock(map_fd, LOCK_EX);
+	fstat(map_fd, &stat_result);
+
+	if (stat_result.st_size == 0) {
+		/* a new upload, a good time to drop the ones that were given up on */
+		expire_uploads();
+
+		if (statvfs_beneath(path, &fs) == 0 && fs.f_bfree * fs.f_frsize < total) {
+			flock(map_fd, LOCK_UN);
+			close(fd);
+			close(map_fd);
+			unlink_beneath(part_path);
+			unlink_beneath(map_path);
+			send_response_basic(cfd, "507", "Insufficient Storage");
+			return;
+		}
+
+		memset(&map, 0, sizeof(map));
+		memcpy(map.magic, "microup", 8);
+		map.total = total;
+		map.segment_size = UPLOAD_SEGMENT_SIZE;
+		count = (total + map.segment_size - 1) / map.segment_size;
+
+		/* sized up front, so segments can be written anywhere without extending the file */
+		if (ftruncate(fd, total) != 0 || ftruncate(map_fd, sizeof(map) + (count + 7) / 8) != 0 || pwrite(map_fd, &map, sizeof(map), 0) != sizeof(map)) {
+			flock(map_fd, LOCK_UN);
+			close(fd);
+			close(map_fd);
+			send_response_with_content(cfd, "500", "Internal Server Error", "text/html", "Can't create upload");
+			return;
+		}
+	} else if (pread(map_fd, &map, sizeof(map), 0) != sizeof(map) || map.total != total) {
+		flock(map_fd, LOCK_UN);
+		close(fd);
+		close(map_fd);
+		send_response_with_content(cfd, "409", "Conflict", "text/html", "Another upload with a different size is in progress");
+		return;
+	}
+
+	flock(map_fd, LOCK_UN);
+
+	/* get expect header */
+	if (get_header_index(*req, "Expect") != -1) {
+		/* only directive is `100-continue` */
+		send_response_basic(cfd, "100", "Continue");
+	}
+
+	/* the peers get the same segment */
+	replicate_request(req, content_length);
+
+	/* write segment at its offset */
+	offset = first;
+
+	while (content_length > written && (read_length = recv_body(cfd, req, buffer, content_length - written > BUFFER_SIZE ? BUFFER_SIZE : content_length - written)) > 0) {
+		if (pwrite(fd, buffer, read_length, offset) != read_length)
+			break;
+
+		offset += read_length;
+		written += read_length;
+	}
+
+	/* only segments that were covered completely count, a cut off segment has to be sent again */
+	first_segment = (first + map.segment_size - 1) / map.segment_size;
+	last_segment = offset == total ? (total + map.segment_size - 1) / map.segment_size : offset / map.segment_size;
+
+	flock(map_fd, LOCK_EX);
+
+	if ((complete = mark_upload_segments(map_fd, first_segment, last_segment, &map)) == 1) {
+		/* all there, publish it (the segments arrived in any order, so it's hashed now) */
+		if (fsync(fd) != 0 || hash_file(fd, digest) != 0 || publish_upload(&fd, part_path, path, digest, 1) != 0) {
+			complete = -1;
 		} else {
-			out_str[counter++] = byte_1 << 2 | ((byte_2 & 0xf0) >> 4);
-			out_str[counter++] = ((byte_2 & 0x0f) << 4) | ((byte_3 & 0x3c) >> 2);
-			out_str[counter++] = ((byte_3 & 0x03) << 6) | (byte_4 & 0x3f);
+			unlink_beneath(map_path);
 		}
 	}
 
-	/* need null byte */
-	out_str[counter++] = '\0';
+	flock(map_fd, LOCK_UN);
+	close(fd);
+	close(map_fd);
 
-	return out_str;
+	update_dir_index(path, index_current);
+
+	/* a peer that didn't complete the file with this segment is behind, it gets the whole file */
+	finish_replication(req, path, strlen(path) + 1, complete == 1 ? 201 : 0, complete == -1);
+
+	if (complete == -1) {
+		send_response_with_content(cfd, "500", "Internal Server Error", "text/html", "Can't write upload");
+	} else if (complete == 1) {
+		reply_replicated(cfd, &created, &unreplicated);
+	} else {
+		accepted.length = snprintf(buffer, sizeof(buffer), "%ld of %ld segments received", map.received, (map.total + map.segment_size - 1) / map.segment_size);
+		reply_replicated(cfd, &accepted, &unreplicated);
+	}
 }
 
-int is_authenticated_http(struct request_t req)
+/* reads exactly length bytes of the body, returns 0 on success and -1 if the body ended first */
+int recv_body_exact(int cfd, struct request_t* req, char* buffer, size_t length, long* remaining)
 {
-	int header_index;
-	char authenticated;
-	char* decoded;
+	ssize_t read_length;
+	size_t read_bytes = 0;
 
-	if (!(header_index = get_header_index(req, "Authorization"))) {
+	if ((long) length > *remaining)
 		return -1;
+
+	while (length > read_bytes) {
+		if ((read_length = recv_body(cfd, req, buffer + read_bytes, length - read_bytes)) <= 0)
+			return -1;
+
+		read_bytes += read_length;
+		*remaining -= read_length;
 	}
 
-	struct header_t authorization = req.headers[header_index];
-	
-	const char* schema = strtok(authorization.value, " ");
-	const char* encoded = strtok(NULL, " ");
+	return 0;
+}
 
-	if (schema == NULL || encoded == NULL)
-		return -2;
+/* reads and throws away length bytes of the body */
+int skip_body(int cfd, struct request_t* req, long length, long* remaining)
+{
+	char buffer[BUFFER_SIZE];
+	long chunk;
 
-	decoded = base64_decode(encoded);  /* [!!] this allocates, MUST free */
+	for (; length > 0; length -= chunk) {
+		chunk = length > BUFFER_SIZE ? BUFFER_SIZE : length;
 
-	if (decoded == NULL) {
-		free(decoded);
-		return -3;
+		if (recv_body_exact(cfd, req, buffer, chunk, remaining) != 0)
+			return -1;
 	}
 
-	const char* username = strtok(decoded, ":");
-	const char* password = strtok(NULL, ":");
+	return 0;
+}
 
-	if (username == NULL || password == NULL) {
-		free(decoded);
-		return -4;
+long tar_octal(const char* field, size_t size)
+{
+	long value = 0;
+	size_t i;
+
+	/* gnu tar writes big numbers in base-256, flagged by the high bit */
+	if ((unsigned char) field[0] & 0x80) {
+		for (i = 1; size > i; i++)
+			value = value << 8 | (unsigned char) field[i];
+
+		return value;
 	}
 
-	authenticated = auth_backend(username, password);
+	for (i = 0; size > i && field[i] == ' '; i++);
 
-	free(decoded);
+	for (; size > i && field[i] >= '0' && field[i] <= '7'; i++)
+		value = value << 3 | (field[i] - '0');
 
-	return authenticated;
+	return value;
 }
 
-void send_directory_listing(int cfd, const char* directory_path)
+int tar_header_is_valid(const struct tar_header_t* header)
 {
+	unsigned int sum = 0;
+	size_t i;
 
-	DIR* dir;
-	struct dirent* entry;
-	size_t size = 0, name_length;
+	for (i = 0; sizeof(*header) > i; i++)
+		sum += (i >= offsetof(struct tar_header_t, checksum) && offsetof(struct tar_header_t, checksum) + sizeof(header->checksum) > i) ? ' ' : ((unsigned char*) header)[i];
 
-	/* open directory */
-	if ((dir = opendir(directory_path)) == NULL) {
-		/* not found */
-		send_not_found(cfd);
+	return sum == (unsigned int) tar_octal(header->checksum, sizeof(header->checksum));
+}
 
-		return;
+/* picks path= and size= out of the records of a pax extended header */
+void tar_parse_pax(char* records, long length, char* path, size_t path_size, long* size)
+{
+	char* record = records;
+	char* key;
+	char* value;
+	long record_length;
+
+	while (records + length > record) {
+		if ((record_length = strtol(record, &key, 10)) <= 0 || record + record_length > records + length || *key != ' ')
+			return;
+
+		key++;
+		record[record_length - 1] = '\0'; /* the newline */
+
+		if ((value = strchr(key, '=')) != NULL) {
+			*value++ = '\0';
+
+			if (strcmp(key, "path") == 0 && path_size > strlen(value)) {
+				strcpy(path, value);
+			} else if (strcmp(key, "size") == 0) {
+				*size = atol(value);
+			}
+		}
+
+		record += record_length;
 	}
+}
 
-	/* count for content length */
-	while ((entry = readdir(dir)) != NULL) {
-		name_length = strlen(entry->d_name);
+/* makes an archive path relative and refuses any that would climb out of the target directory, returns -1 if refused */
+int sanitize_archive_path(char* path)
+{
+	char* component;
+	size_t length;
 
-		if (entry->d_type == DT_DIR) name_length++; /* add for the "/" */
+	/* drop leading "/" and "./" */
+	while (path[0] == '/' || (path[0] == '.' && path[1] == '/'))
+		memmove(path, path + (path[0] == '/' ? 1 : 2), strlen(path) + 1);
 
-		size += DIRLEN(name_length) - 1;
+	length = strlen(path);
+
+	while (length > 0 && path[length - 1] == '/')
+		path[--length] = '\0';
+
+	if (length == 0 || strcmp(path, ".") == 0)
+		return -1;
+
+	for (component = path; component; component = strchr(component, '/') ? strchr(component, '/') + 1 : NULL)
+		if (strncmp(component, "..", 2) == 0 && (component[2] == '/' || component[2] == '\0'))
+			return -1;
+
+	return 0;
+}
+
+/* creates the directories leading up to (and including, if is_directory) path, like mkdir -p */
+int make_directories(char* path, size_t from, int is_directory)
+{
+	char* slash;
+
+	for (slash = strchr(path + from, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+
+		if (mkdir_beneath(path, 0777) != 0 && errno != EEXIST) {
+			*slash = '/';
+			return -1;
+		}
+
+		*slash = '/';
 	}
-	
-	/* start http response */
-	send_response_with_content_length(cfd, "200", "OK", "text/html", size);
-	rewinddir(dir);
 
-	/* iterate through directory and send as HTML */
-	while ((entry = readdir(dir)) != NULL)
-		send_directory_entry(cfd, entry);
-		
-	/* clean up directory */
-	closedir(dir);
+	if (is_directory && mkdir_beneath(path, 0777) != 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
 }
 
-void handle_get_request(int cfd, struct request_t req)
+/*
+ * writes size bytes of the body into a temporary file next to file_path and renames it into place,
+ * so nobody ever sees a half written entry. returns NULL on success or what went wrong, the entry's
+ * bytes are consumed either way unless the body itself ended early (*remaining goes negative).
+ */
+const char* extract_tar_file(int cfd, struct request_t* req, const char* file_path, long size, mode_t mode, long* remaining)
 {
-	/* result of stat */
+	char temporary_path[PATH_BUFFER_SIZE * 2 + 32];
+	char buffer[EXTRACT_BUFFER_SIZE];
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	const char* error = NULL;
+	struct sha256_t sha;
+	long chunk;
+	int fd;
+
+	if ((fd = create_temporary_beneath(file_path, temporary_path, sizeof(temporary_path))) < 0) {
+		if (skip_body(cfd, req, size, remaining) != 0) *remaining = -1;
+		return "can't create file";
+	}
+
+	sha256_init(&sha);
+
+	for (; size > 0; size -= chunk) {
+		chunk = size > EXTRACT_BUFFER_SIZE ? EXTRACT_BUFFER_SIZE : size;
+
+		if (recv_body_exact(cfd, req, buffer, chunk, remaining) != 0) {
+			*remaining = -1;
+			error = "archive ended in the middle of the file";
+			break;
+		}
+
+		sha256_update(&sha, buffer, chunk);
+
+		if (error == NULL && write(fd, buffer, chunk) != chunk)
+			error = "can't write file"; /* keep reading to stay in step with the archive */
+	}
+
+	sha256_final(&sha, digest);
+	fchmod(fd, mode & 0777);
+
+	if (error == NULL && publish_upload(&fd, temporary_path, file_path, digest, 1) != 0)
+		error = "can't rename file into place";
+
+	if (error != NULL)
+		unlink_beneath(temporary_path);
+
+	close(fd);
+
+	return error;
+}
+
+/*
+ * PUT /some/dir/?extract=tar, bulk upload: the body is a tar stream that is extracted into the
+ * directory as it arrives. one request (and one authentication) for any number of files. regular
+ * files and directories are extracted, every file is published atomically, links and special files
+ * are skipped. answers with one NDJSON line per entry.
+ */
+void handle_put_extract_request(int cfd, struct request_t* req, long content_length)
+{
+	struct tar_header_t header;
 	struct stat stat_result;
+	struct buffer_t summary = { NULL, 0, 0 }, extracted = { NULL, 0, 0 }, unreplicated_summary = { NULL, 0, 0 };
+	struct reply_t taken = { "200", "OK", "application/x-ndjson", NULL, 0 }, not_taken = { "503", "Service Unavailable", "application/x-ndjson", NULL, 0 };
+	char name[PATH_BUFFER_SIZE], next_name[PATH_BUFFER_SIZE], entry_path[PATH_BUFFER_SIZE * 2];
+	char* pax;
+	const char* error;
+	const char* status;
+	long remaining = content_length, size, next_size = -1, blocks, consumed;
+	size_t target_length;
+	int malformed = 0, index_current;
+	const char* path = relative_path(req->path);
+
+	if (stat_beneath(path, &stat_result) != 0 || !S_ISDIR(stat_result.st_mode)) {
+		send_response_with_content(cfd, "409", "Conflict", "text/html", "Can only extract into an existing directory");
+		return;
+	}
 
-	if (stat(req.path, &stat_result) == 0) {
-		/* exists */
-		if (S_ISREG(stat_result.st_mode) || S_ISLNK(stat_result.st_mode)) {
-			/* send file over http */
-			send_http_file(cfd, req.path, stat_result.st_size);
-		} else if (S_ISDIR(stat_result.st_mode)) {
-			/* list directory over http */
-			send_directory_listing(cfd, req.path);
+	/* get expect header */
+	if (get_header_index(*req, "Expect") != -1) {
+		/* only directive is `100-continue` */
+		send_response_basic(cfd, "100", "Continue");
+	}
+
+	/* the peers extract the same archive */
+	replicate_request(req, content_length);
+
+	next_name[0] = '\0';
+	/* entries of the root itself go without a "./" in front */
+	target_length = strcmp(path, ".") == 0 ? 0 : strlen(path) + 1;
+
+	while (remaining > 0) {
+		if (recv_body_exact(cfd, req, (char*) &header, sizeof(header), &remaining) != 0) {
+			malformed = 1;
+			break;
+		}
+
+		/* a zero block ends the archive */
+		if (header.name[0] == '\0' && header.typeflag == '\0' && header.checksum[0] == '\0')
+			break;
+
+		if (!tar_header_is_valid(&header)) {
+			malformed = 1;
+			break;
+		}
+
+		size = tar_octal(header.size, sizeof(header.size));
+
+		/* extended headers describe the entry that follows them */
+		if (header.typeflag == 'x' || header.typeflag == 'L') {
+			blocks = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+			if (size > TAR_MAX_PAX_SIZE) {
+				if (skip_body(cfd, req, blocks, &remaining) != 0) malformed = 1;
+				continue;
+			}
+
+			pax = malloc(blocks + 1);
+
+			if (recv_body_exact(cfd, req, pax, blocks, &remaining) != 0) {
+				free(pax);
+				malformed = 1;
+				break;
+			}
+
+			pax[size] = '\0';
+
+			if (header.typeflag == 'L') {
+				snprintf(next_name, sizeof(next_name), "%s", pax);
+			} else {
+				tar_parse_pax(pax, size, next_name, sizeof(next_name), &next_size);
+			}
+
+			free(pax);
+			continue;
+		}
+
+		if (next_name[0]) {
+			strcpy(name, next_name);
+		} else if (header.prefix[0] && memcmp(header.magic, "ustar", 5) == 0) {
+			snprintf(name, sizeof(name), "%.*s/%.*s", (int) sizeof(header.prefix), header.prefix, (int) sizeof(header.name), header.name);
+		} else {
+			snprintf(name, sizeof(name), "%.*s", (int) sizeof(header.name), header.name);
+		}
+
+		if (next_size >= 0)
+			size = next_size;
+
+		next_name[0] = '\0';
+		next_size = -1;
+
+		error = NULL;
+		status = "created";
+		consumed = 0;
+
+		if (header.typeflag != '0' && header.typeflag != '\0' && header.typeflag != '5') {
+			status = "skipped";
+			error = "unsupported entry type";
+		} else if (sanitize_archive_path(name) != 0) {
+			error = "path outside of the target directory";
+		} else {
+			if (target_length) {
+				snprintf(entry_path, sizeof(entry_path), "%s/%s", path, name);
+			} else {
+				snprintf(entry_path, sizeof(entry_path), "%s", name);
+			}
+
+			index_current = is_dir_index_current(entry_path);
+
+			if (is_reserved_path(entry_path)) {
+				error = "path reserved for the server";
+			} else if (make_directories(entry_path, target_length, header.typeflag == '5') != 0) {
+				error = "can't create directory";
+			} else if (header.typeflag != '5') {
+				error = extract_tar_file(cfd, req, entry_path, size, tar_octal(header.mode, sizeof(header.mode)), &remaining);
+				consumed = size;
+
+				/* what peers that missed the archive get caught up on */
+				if (error == NULL)
+					buffer_append(&extracted, entry_path, strlen(entry_path) + 1);
+			}
+
+			update_dir_index(entry_path, index_current);
+		}
+
+		if (error != NULL && strcmp(status, "skipped") != 0)
+			status = "error";
+
+		/* whatever wasn't extracted, and the padding up to the next header */
+		if (remaining < 0 || skip_body(cfd, req, size - consumed, &remaining) != 0 || skip_body(cfd, req, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE, &remaining) != 0)
+			malformed = 1;
+
+		buffer_printf(&summary, "{\"path\":");
+		buffer_append_json_string(&summary, name);
+		buffer_printf(&summary, ",\"status\":\"%s\"", status);
+
+		if (error != NULL) {
+			buffer_printf(&summary, ",\"error\":");
+			buffer_append_json_string(&summary, error);
 		}
+
+		buffer_append(&summary, "}\n", 2);
+
+		if (malformed)
+			break;
+	}
+
+	if (malformed)
+		buffer_printf(&summary, "{\"error\":\"malformed or truncated archive\"}\n");
+
+	/* read the rest (the archive's end blocks are usually padded to a whole record), closing with unread data would reset the connection */
+	if (remaining > 0)
+		skip_body(cfd, req, remaining, &remaining);
+
+	/* the entries are caught up on one by one, whatever went wrong with the archive as a whole */
+	finish_replication(req, extracted.data, extracted.length, 0, 0);
+	free(extracted.data);
+
+	if (malformed) {
+		send_response_with_content_length(cfd, "400", "Bad Request", "application/x-ndjson", summary.length);
+		send_all(cfd, summary.data, summary.length);
 	} else {
-		/* file does not exit */
-		send_not_found(cfd);
+		buffer_append(&unreplicated_summary, summary.data, summary.length);
+		buffer_printf(&unreplicated_summary, "{\"error\":\"not replicated to enough peers\"}\n");
+
+		taken.body = summary.data;
+		taken.length = summary.length;
+		not_taken.body = unreplicated_summary.data;
+		not_taken.length = unreplicated_summary.length;
+		reply_replicated(cfd, &taken, &not_taken);
+		free(unreplicated_summary.data);
 	}
+
+	free(summary.data);
 }
 
 void handle_put_request(int cfd, struct request_t req)
 {
-	int read_length, fd, header_index;
+	int read_length, fd, header_index, announced, written = 1, index_current;
 	long read_bytes = 0, content_length;
-	char buffer[BUFFER_SIZE];
+	char buffer[BUFFER_SIZE], extract[8], temporary_path[PATH_BUFFER_SIZE * 2 + 32], object_path[OBJECT_PATH_SIZE];
+	unsigned char digest[SHA256_DIGEST_SIZE], expected_digest[SHA256_DIGEST_SIZE];
+	struct reply_t created = { "201", "Created", NULL, NULL, 0 };
+	struct reply_t unreplicated = { "503", "Service Unavailable", "text/html", NOT_REPLICATED, sizeof(NOT_REPLICATED) - 1 };
+	const char* error = NULL;
+	const char* bad_request = NULL;
+	struct sha256_t sha;
+	struct stat stat_result;
 	struct statvfs fs;
+	const char* path = relative_path(req.path);
 
 	/* must be authenticated */
 	if (1 > is_authenticated_http(req)) {
 		send_response_basic(cfd, "401", "Unauthorized");
 		return;
 	}
+
+	if (is_reserved_path(path)) {
+		send_response_with_content(cfd, "403", "Forbidden", "text/html", "Reserved for the server");
+		return;
+	}
 	
 	/* get content length */
 	if ((header_index = get_header_index(req, "Content-Length")) == -1) {		
@@ -496,7 +4125,19 @@ void handle_put_request(int cfd, struct request_t req)
 
 	content_length = atol(req.headers[header_index].value);
 
-	if (statvfs(req.path, &fs) != 0) {
+	/* mutations from a peer were let in by the rate limits where they started */
+	if (get_header_index(req, REPLICA_HEADER) == -1 && refuse_over_limit(cfd, &global_upload_bucket, current_client != NULL ? &current_client->upload : NULL))
+		return;
+
+	traffic[T_UPLOAD].requests++;
+
+	/* one segment of a file uploaded in pieces */
+	if ((header_index = get_header_index(req, "Content-Range")) != -1) {
+		handle_put_range_request(cfd, &req, content_length, req.headers[header_index].value);
+		return;
+	}
+
+	if (statvfs_beneath(path, &fs) != 0) {
 		/* get space available in filesystem */	
 		fprintf(stderr, SERVER_NAME": warn: could not get filesystem information (space available)\n");
 	} else if (fs.f_bfree * fs.f_frsize < content_length) {
@@ -505,12 +4146,27 @@ void handle_put_request(int cfd, struct request_t req)
 		return;
 	}
 
-	/* open file for writing, create it */
-	if (creat(req.path, 0666) < 0) {
-		send_response_with_content(cfd, "500", "Internal Server Error", "text/html", "Can't create file");
+	/* bulk upload of a tar archive */
+	if (get_query_param(req, "extract", extract, sizeof(extract))) {
+		if (strcmp(extract, "tar") == 0) {
+			handle_put_extract_request(cfd, &req, content_length);
+		} else {
+			send_response_with_content(cfd, "400", "Bad Request", "text/html", "extract must be tar");
+		}
+
+		return;
+	}
+
+	/* a body whose digest the client gave is checked, and not written at all when the object store has it already */
+	if ((announced = get_request_digest(&req, expected_digest)) && content_store != C_NONE) {
+		get_object_path(expected_digest, object_path);
+		written = stat_beneath(object_path, &stat_result) != 0 || stat_result.st_size != content_length;
 	}
 
-	if ((fd = open(req.path, O_WRONLY)) == -1) {
+	/* written next to the file and renamed over it once complete, readers never see half an upload */
+	index_current = is_dir_index_current(path);
+
+	if ((fd = create_temporary_beneath(path, temporary_path, sizeof(temporary_path))) == -1) {
 		/* could not open */
 		send_response_with_content(cfd, "500", "Internal Server Error", "text/html", "Can't open file");
 
@@ -523,22 +4179,59 @@ void handle_put_request(int cfd, struct request_t req)
 		send_response_basic(cfd, "100", "Continue");
 	}
 
-	/* write to filesystem */
-	while ((read_length = recv(cfd, buffer, BUFFER_SIZE, 0)) > 0) {
+	/* the peers get the body as it arrives */
+	replicate_request(&req, content_length);
+
+	/* write to filesystem, hashing as it arrives */
+	sha256_init(&sha);
+
+	while (content_length > read_bytes && (read_length = recv_body(cfd, &req, buffer, content_length - read_bytes > BUFFER_SIZE ? BUFFER_SIZE : content_length - read_bytes)) > 0) {
 		read_bytes += read_length;
-		write(fd, buffer, read_length);
+		sha256_update(&sha, buffer, read_length);
+
+		if (written && error == NULL && write(fd, buffer, read_length) != read_length)
+			error = "Can't write file"; /* keep reading, closing with unread data would reset the connection */
+	}
+
+	sha256_final(&sha, digest);
+
+	if (content_length > read_bytes) {
+		bad_request = "Body ended before Content-Length";
+	} else if (announced && memcmp(digest, expected_digest, SHA256_DIGEST_SIZE) != 0) {
+		bad_request = "Body does not match its Digest";
+	} else if (error == NULL && publish_upload(&fd, temporary_path, path, digest, written) != 0) {
+		error = "Can't write file";
+	} else if (error == NULL) {
+		temporary_path[0] = '\0';
+	}
 
-		if (read_bytes >= content_length) break;
+	finish_replication(&req, path, strlen(path) + 1, 0, bad_request != NULL || error != NULL);
+
+	if (bad_request != NULL) {
+		send_response_with_content(cfd, "400", "Bad Request", "text/html", bad_request);
+	} else if (error != NULL) {
+		send_response_with_content(cfd, "500", "Internal Server Error", "text/html", error);
+	} else {
+		reply_replicated(cfd, &created, &unreplicated);
 	}
 
-	send_response_basic(cfd, "201", "Created");
+	/* not published */
+	if (temporary_path[0])
+		unlink_beneath(temporary_path);
 
 	close(fd);
+	update_dir_index(path, index_current);
 }
 
 void handle_delete_request(int cfd, struct request_t req)
 {
 	struct stat stat_result;
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	int exists, failed, hashed, index_current;
+	double started;
+	struct reply_t deleted = { "204", "No Content", NULL, NULL, 0 };
+	struct reply_t unreplicated = { "503", "Service Unavailable", "text/html", NOT_DELETED_ON_PEERS, sizeof(NOT_DELETED_ON_PEERS) - 1 };
+	const char* path = relative_path(req.path);
 
 	/* must be authenticated */
 	if (1 > is_authenticated_http(req)) {
@@ -546,7 +4239,16 @@ void handle_delete_request(int cfd, struct request_t req)
 		return;
 	}
 
-	if (stat(req.path, &stat_result) == 0) {
+	if (is_reserved_path(path)) {
+		send_response_with_content(cfd, "403", "Forbidden", "text/html", "Reserved for the server");
+		return;
+	}
+
+	started = phase_start(P_STAT);
+	exists = stat_beneath(path, &stat_result) == 0;
+	phase_end(&current_trace, P_STAT, started);
+
+	if (exists) {
 		/* exists */
 		if (!(S_ISREG(stat_result.st_mode) || S_ISLNK(stat_result.st_mode))) {
 			send_response_with_content(cfd, "403", "Forbidden", "text/html", "Can only delete regular files or links");
@@ -557,15 +4259,26 @@ void handle_delete_request(int cfd, struct request_t req)
 		return;
 	}
 
-	if (remove(req.path)) {
+	/* the peers delete it at the same time */
+	replicate_request(&req, -1);
+	hashed = content_store != C_NONE && get_path_content_hash(path, digest);
+	index_current = is_dir_index_current(path);
+	failed = unlink_beneath(path) != 0;
+	update_dir_index(path, index_current);
+
+	if (!failed && hashed)
+		release_object(digest);
+	finish_replication(&req, path, strlen(path) + 1, 0, failed);
+
+	if (failed) {
 		send_response_basic(cfd, "500", "Internal Server Error");
 		return;
 	}
 
-	send_response_basic(cfd, "204", "No Content");
+	reply_replicated(cfd, &deleted, &unreplicated);
 }
 
-enum parse_error parse_request(int cfd, struct sockaddr client_address, struct request_t* request)
+enum parse_error parse_request(int cfd, struct sockaddr_storage client_address, struct request_t* request)
 {
 	ssize_t size;
 	char buffer[BUFFER_SIZE];
@@ -573,6 +4286,7 @@ enum parse_error parse_request(int cfd, struct sockaddr client_address, struct r
 	int i, char_count = 0, end_char_count = 0, line_count = 0, header_name_count = 0, header_value_count = 0;
 	enum expecting current = E_METHOD;
 	struct request_t req = {};
+	char* query;
 
 	/* reset buffers */
 	memset(path, 0, sizeof(path));
@@ -705,6 +4419,13 @@ enum parse_error parse_request(int cfd, struct sockaddr client_address, struct r
 			}
 			
 			char_count++;
+
+			/* end of headers, keep whatever was read past it as the start of the body */
+			if (end_char_count >= 4) {
+				req.bsize = size - i - 1;
+				memcpy(req.body, buffer + i + 1, req.bsize);
+				break;
+			}
 		}
 	} while (size > 0 && 4 > end_char_count); /* 4 end characters in a row is the header-body separator of request */
 
@@ -730,136 +4451,841 @@ enum parse_error parse_request(int cfd, struct sockaddr client_address, struct r
 		return ERR_UNSUPPORTED_HTTP_VERSION;
 	}
 
-	/* set path */
+	/* set path, the query string is kept apart */
 	strncpy(req.path, path, req.psize);
 
+	if ((query = strchr(req.path, '?')) != NULL) {
+		strcpy(req.query, query + 1);
+		*query = '\0';
+	}
+
+	/* decode it and drop repeated and trailing slashes */
+	if (percent_decode(req.path, 0) != 0)
+		return ERR_MALFORMED_PATH;
+
+	for (i = 0, char_count = 0; req.path[i]; i++)
+		if (req.path[i] != '/' || char_count == 0 || req.path[char_count - 1] != '/')
+			req.path[char_count++] = req.path[i];
+
+	if (char_count > 1 && req.path[char_count - 1] == '/')
+		char_count--;
+
+	req.path[char_count] = '\0';
+	req.psize = char_count;
+
+	/* one spelling per path, checks like is_reserved_path() depend on it */
+	if (has_dot_component(req.path))
+		return ERR_MALFORMED_PATH;
+
 	/* copy local request into the passed in pointer */
 	memcpy(request, &req, sizeof(req));
 
 	return 0;
 }
 
+ino_t inode_of(const char* path)
+{
+	struct stat stat_result;
+
+	return stat(path, &stat_result) == 0 ? stat_result.st_ino : 0;
+}
+
+int is_socket_file(const char* path)
+{
+	struct stat stat_result;
+
+	return lstat(path, &stat_result) == 0 && S_ISSOCK(stat_result.st_mode);
+}
+
+/* closes the listening sockets, connections already accepted go on */
+void stop_listening()
+{
+	int i;
+
+	for (i = 0; listener_count > i; i++) {
+		close(listeners[i].fd);
+		shutdown(listeners[i].fd, SHUT_RDWR);
+	}
+
+	if (handoff_fd >= 0)
+		close(handoff_fd);
+}
+
 void on_signal(int signal)
 {
 	/* stop main loop */
 	running = 0;
 	
-	/* close server socket */
-	close(sfd);
-	shutdown(sfd, SHUT_RDWR);
+	/* close server sockets */
+	stop_listening();
+
+	/* what's in flight gets a deadline to finish */
+	alarm(DRAIN_TIMEOUT);
+}
+
+void on_drain_timeout(int signal)
+{
+	_exit(0);
+}
+
+/* creates, binds and starts listening on the socket of a listener, returns -1 on error */
+/* unix:<path>, <ipv4>:<port> or [<ipv6>]:<port> into a socket address, returns 0 or -1 */
+int parse_address(const char* spec, struct sockaddr_storage* address, socklen_t* address_length)
+{
+	struct sockaddr_un* unix_address = (struct sockaddr_un*) address;
+	struct sockaddr_in* ipv4_address = (struct sockaddr_in*) address;
+	struct sockaddr_in6* ipv6_address = (struct sockaddr_in6*) address;
+	char host[PATH_BUFFER_SIZE];
+	char* port;
+
+	memset(address, 0, sizeof(*address));
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		if (strlen(spec + 5) >= sizeof(unix_address->sun_path))
+			return -1;
+
+		unix_address->sun_family = AF_UNIX;
+		strcpy(unix_address->sun_path, spec + 5);
+		*address_length = sizeof(*unix_address);
+	} else {
+		snprintf(host, sizeof(host), "%s", spec);
+
+		if ((port = strrchr(host, ':')) == NULL)
+			return -1;
+
+		*port++ = '\0';
+
+		if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+			host[strlen(host) - 1] = '\0';
+			ipv6_address->sin6_family = AF_INET6;
+			ipv6_address->sin6_port = htons(atoi(port));
+			*address_length = sizeof(*ipv6_address);
+
+			if (inet_pton(AF_INET6, host + 1, &ipv6_address->sin6_addr) != 1)
+				return -1;
+		} else {
+			ipv4_address->sin_family = AF_INET;
+			ipv4_address->sin_port = htons(atoi(port));
+			*address_length = sizeof(*ipv4_address);
+
+			if (inet_pton(AF_INET, host, &ipv4_address->sin_addr) != 1)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+int open_listener(struct listener_t* listener)
+{
+	struct sockaddr_storage address;
+	struct sockaddr_un* unix_address = (struct sockaddr_un*) &address;
+	struct sockaddr_in6* ipv6_address = (struct sockaddr_in6*) &address;
+	socklen_t address_length;
+	char spec[PATH_BUFFER_SIZE];
+	char* mode = NULL;
+	const int ALLOW = 1, DISALLOW = 0;
+	mode_t old_umask = 0;
+	int result;
+
+	snprintf(spec, sizeof(spec), "%s", listener->spec);
+
+	/* unix:<path>[:<mode>] */
+	if (strncmp(spec, "unix:", 5) == 0 && (mode = strrchr(spec + 5, ':')) != NULL && mode[1] && strspn(mode + 1, "01234567") == strlen(mode + 1)) {
+		*mode++ = '\0';
+	} else {
+		mode = NULL;
+	}
+
+	if (parse_address(spec, &address, &address_length) != 0)
+		return -1;
+
+	/* create socket */
+	if ((listener->fd = socket(address.ss_family, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	if (address.ss_family == AF_UNIX) {
+		/*
+		 * a socket file left behind by a previous run would make bind fail. only a socket nobody accepts on
+		 * is removed, anything else at the path (or a running server's socket) makes bind fail instead
+		 */
+		if (is_socket_file(unix_address->sun_path) && connect(listener->fd, (struct sockaddr*) &address, address_length) < 0 && errno == ECONNREFUSED)
+			unlink(unix_address->sun_path);
+	} else {
+		/* allow rebinding of socket */
+		if (setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, (void*) &ALLOW, sizeof(ALLOW)) < 0)
+			fprintf(stderr, SERVER_NAME": warn: can't set SO_REUSEADDR\n");
+
+		if (setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT, (void*) &ALLOW, sizeof(ALLOW)) < 0) 
+			fprintf(stderr, SERVER_NAME": warn: can't set SO_REUSEPORT\n");
+	}
+
+	/* [::] takes IPv4 connections too */
+	if (address.ss_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&ipv6_address->sin6_addr) && setsockopt(listener->fd, IPPROTO_IPV6, IPV6_V6ONLY, (void*) &DISALLOW, sizeof(DISALLOW)) < 0)
+		fprintf(stderr, SERVER_NAME": warn: can't make %s dual-stack\n", listener->spec);
+
+	/* a unix socket gets its permissions as it's created, there's no moment it's more open than asked for */
+	if (mode != NULL)
+		old_umask = umask(~strtol(mode, NULL, 8) & 0777);
+
+	/* bind to address and listen */
+	result = bind(listener->fd, (struct sockaddr*) &address, address_length);
+
+	if (mode != NULL)
+		umask(old_umask);
+
+	if (result < 0 || listen(listener->fd, BACKLOG) < 0) {
+		close(listener->fd);
+		return -1;
+	}
+
+	if (address.ss_family == AF_UNIX) {
+		strcpy(listener->unix_path, unix_address->sun_path);
+		listener->unix_inode = inode_of(listener->unix_path);
+	}
+
+	return 0;
+}
+
+void handle_connection(int cfd, struct sockaddr_storage client_address)
+{
+	/* parse it */
+	struct request_t req;
+	enum parse_error parse_error;
+	double started;
+
+	/* for rate limits and local only endpoints */
+	current_client = get_client(&client_address);
+	current_client_is_local = is_local_address(&client_address);
+	current_replication = NULL;
+	connection_kept = 0;
+
+	memset(&current_trace, 0, sizeof(current_trace));
+	current_trace.started = monotonic_now();
+	current_trace.time = time(NULL);
+
+	if (current_client != NULL)
+		strcpy(current_trace.client, current_client->address);
+
+	started = phase_start(P_PARSE);
+	parse_error = parse_request(cfd, client_address, &req);
+	phase_end(&current_trace, P_PARSE, started);
+
+	if (parse_error == 0) {
+		current_trace.method = method_as_string(req.method);
+		strcpy(current_trace.path, req.path);
+
+		/* a client can't pass its mutations off as replicated ones, those skip the upload limits and aren't passed on */
+		if (get_header_index(req, REPLICA_HEADER) != -1 && !is_replica_request(&req, &client_address))
+			remove_header(&req, get_header_index(req, REPLICA_HEADER));
+	}
+
+	if (parse_error) {
+		switch (parse_error) {
+			case ERR_UNSUPPORTED_HTTP_VERSION:
+			case ERR_HTTP_VERSION_TOO_BIG:
+				send_response_basic(cfd, "505", "HTTP Version Not Supported");
+				break;
+
+			case ERR_UNSUPPORTED_METHOD:
+			case ERR_METHOD_TOO_BIG:
+				send_response_basic(cfd, "405", "Method Not Allowed");
+				break;
+
+			case ERR_EXPECTING_UNKNOWN:
+				send_response_basic(cfd, "500", "Internal Server Error");
+				break;
+
+			case ERR_TOO_MANY_HEADERS:
+			case ERR_HEADER_VALUE_TOO_BIG:
+			case ERR_HEADER_NAME_TOO_BIG:
+				send_response_basic(cfd, "431", "Request Header Fields Too Large");
+				break;
+			
+			case ERR_EXPECTED_NAME_VALUE_SPACE:
+			case ERR_EXPECTED_NEW_LINE:
+			case ERR_MALFORMED_PATH:
+				send_response_basic(cfd, "400", "Bad Request");
+				break;
+
+			case ERR_PATH_TOO_BIG:
+				send_response_basic(cfd, "414", "Request-URI Too Long");
+				break;
+		}
+	} else {
+		print_request(req);
+		/* route it & send back response */
+		switch (req.method) {
+			case M_GET:
+				handle_get_request(cfd, req);
+				break;
+
+			case M_PUT:
+				handle_put_request(cfd, req);
+				break;
+
+			case M_DELETE:
+				handle_delete_request(cfd, req);
+				break;
+
+		}
+	}
+
+	/* a mutation whose peers all answered (or weren't waited for) doesn't keep its slot */
+	if (current_replication != NULL)
+		settle_replication(current_replication);
+
+	/* a scheduled transfer (or the main loop, for a client held for its peers' answers) finishes it */
+	if (!connection_kept)
+		trace_done(&current_trace);
+}
+
+/* sends the paths in the caches, so the new process starts warm, a message per batch of lines */
+void send_hot_cache_keys(int fd)
+{
+	char message[HANDOFF_MESSAGE_SIZE];
+	size_t length = 0;
+	int i;
+
+	for (i = 0; DIRFD_CACHE_SIZE + DIR_INDEX_CACHE_SIZE > i; i++) {
+		const char* path = DIRFD_CACHE_SIZE > i ? dirfd_cache[i].path : dir_indexes[i - DIRFD_CACHE_SIZE].path;
+
+		if (path[0] == '\0')
+			continue;
+
+		if (length + strlen(path) + 3 > sizeof(message)) {
+			send(fd, message, length, 0);
+			length = 0;
+		}
+
+		length += snprintf(message + length, sizeof(message) - length, "%c %s\n", DIRFD_CACHE_SIZE > i ? 'D' : 'I', path);
+	}
+
+	if (length > 0)
+		send(fd, message, length, 0);
+
+	send(fd, "END", 3, 0);
+}
+
+/*
+ * a new process connected to the handoff socket: send it the listening sockets (SCM_RIGHTS),
+ * with the address each one was opened for, then the keys of the caches. returns 1 once the
+ * new process confirmed it took over, from then on it accepts and this one only finishes up.
+ */
+int hand_over()
+{
+	int fd, i;
+	char message[HANDOFF_MESSAGE_SIZE];
+	size_t length = 0;
+	struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+	struct iovec io;
+	struct msghdr header;
+	struct cmsghdr* control_header;
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+	} control;
+
+	if ((fd = accept(handoff_fd, NULL, NULL)) < 0)
+		return 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void*) &timeout, sizeof(timeout));
+
+	if (recv(fd, message, sizeof(message), 0) != 7 || strncmp(message, "HANDOFF", 7) != 0) {
+		close(fd);
+		return 0;
+	}
+
+	/* "<spec>\t<unix socket path>" per listener, in the order of the fds */
+	for (i = 0; listener_count > i; i++)
+		length += snprintf(message + length, sizeof(message) - length, "%s\t%s\n", listeners[i].spec, listeners[i].unix_path);
+
+	memset(&header, 0, sizeof(header));
+	memset(&control, 0, sizeof(control));
+	io.iov_base = message;
+	io.iov_len = length;
+	header.msg_iov = &io;
+	header.msg_iovlen = 1;
+	header.msg_control = control.buffer;
+	header.msg_controllen = CMSG_SPACE(sizeof(int) * listener_count);
+
+	control_header = CMSG_FIRSTHDR(&header);
+	control_header->cmsg_level = SOL_SOCKET;
+	control_header->cmsg_type = SCM_RIGHTS;
+	control_header->cmsg_len = CMSG_LEN(sizeof(int) * listener_count);
+
+	for (i = 0; listener_count > i; i++)
+		((int*) CMSG_DATA(control_header))[i] = listeners[i].fd;
+
+	if (sendmsg(fd, &header, 0) < 0) {
+		close(fd);
+		return 0;
+	}
+
+	send_hot_cache_keys(fd);
+
+	/* until the new process says it's ready, keep serving */
+	if (recv(fd, message, 1, 0) != 1 || message[0] != 'K') {
+		fprintf(stderr, SERVER_NAME": warn: new process didn't take over, still serving\n");
+		close(fd);
+		return 0;
+	}
+
+	close(fd);
+
+	return 1;
+}
+
+/*
+ * asks the process serving on the handoff socket for its listening sockets and takes the ones
+ * for the same addresses, returns 1 once it has, 0 if there is no such process. if it doesn't answer
+ * in time, it is told to stop (SIGTERM) and this process listens next to it (SO_REUSEPORT) instead, -1.
+ */
+int take_over(const char* path)
+{
+	int fd, fds[MAX_LISTENERS], fd_count = 0, i, j;
+	char message[HANDOFF_MESSAGE_SIZE];
+	char* line;
+	char* unix_path;
+	ssize_t length;
+	struct sockaddr_un address;
+	struct ucred credentials;
+	socklen_t credentials_length = sizeof(credentials);
+	struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+	struct buffer_t cached = { NULL, 0, 0 };
+	struct iovec io;
+	struct msghdr header;
+	struct cmsghdr* control_header;
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+	} control;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+		return 0;
+
+	if (connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+		close(fd);
+		return 0;
+	}
+
+	/* without the pid of the old process there's nobody to stop if it doesn't answer */
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, (void*) &credentials, &credentials_length) != 0 || credentials.pid <= 0)
+		credentials.pid = 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void*) &timeout, sizeof(timeout));
+
+	memset(&header, 0, sizeof(header));
+	io.iov_base = message;
+	io.iov_len = sizeof(message) - 1;
+	header.msg_iov = &io;
+	header.msg_iovlen = 1;
+	header.msg_control = control.buffer;
+	header.msg_controllen = sizeof(control.buffer);
+
+	if (send(fd, "HANDOFF", 7, 0) != 7 || (length = recvmsg(fd, &header, 0)) <= 0) {
+		if (credentials.pid > 0) {
+			fprintf(stderr, SERVER_NAME": warn: process %d didn't hand its sockets over, stopping it\n", (int) credentials.pid);
+			kill(credentials.pid, SIGTERM);
+		} else {
+			fprintf(stderr, SERVER_NAME": warn: the running process didn't hand its sockets over\n");
+		}
+
+		close(fd);
+		return -1;
+	}
+
+	message[length] = '\0';
+
+	for (control_header = CMSG_FIRSTHDR(&header); control_header; control_header = CMSG_NXTHDR(&header, control_header))
+		if (control_header->cmsg_level == SOL_SOCKET && control_header->cmsg_type == SCM_RIGHTS)
+			for (fd_count = 0; (control_header->cmsg_len - CMSG_LEN(0)) / sizeof(int) > (size_t) fd_count && MAX_LISTENERS > fd_count; fd_count++)
+				fds[fd_count] = ((int*) CMSG_DATA(control_header))[fd_count];
+
+	/* keep the sockets of addresses still configured */
+	for (j = 0, line = strtok(message, "\n"); line && fd_count > j; j++, line = strtok(NULL, "\n")) {
+		unix_path = strchr(line, '\t');
+
+		if (unix_path != NULL)
+			*unix_path++ = '\0';
+
+		for (i = 0; listener_count > i; i++) {
+			if (!listeners[i].inherited && strcmp(listeners[i].spec, line) == 0) {
+				listeners[i].fd = fds[j];
+				listeners[i].inherited = 1;
+				strncpy(listeners[i].unix_path, unix_path ? unix_path : "", sizeof(listeners[i].unix_path) - 1);
+				listeners[i].unix_inode = inode_of(listeners[i].unix_path);
+				fds[j] = -1;
+				break;
+			}
+		}
+
+		if (fds[j] >= 0) {
+			close(fds[j]);
+			fds[j] = -1;
+		}
+	}
+
+	for (; fd_count > j; j++)
+		close(fds[j]);
+
+	/* what the old process had cached, kept for after it let go: the old process only waits HANDOFF_TIMEOUT for 'K' */
+	while ((length = recv(fd, message, sizeof(message) - 1, 0)) > 0 && !(length == 3 && strncmp(message, "END", 3) == 0)) {
+		buffer_append(&cached, message, length);
+		buffer_append(&cached, "\n", 1);
+	}
+
+	/* ready, the old process stops accepting */
+	send(fd, "K", 1, 0);
+	close(fd);
+
+	/* warm the caches, new connections wait in the backlog meanwhile */
+	if (cached.length > 0) {
+		buffer_append(&cached, "", 1);
+
+		for (line = strtok(cached.data, "\n"); line; line = strtok(NULL, "\n")) {
+			if (strlen(line) > 2 && line[0] == 'D') {
+				get_dirfd(line + 2);
+			} else if (strlen(line) > 2 && line[0] == 'I') {
+				get_dir_index(line + 2);
+			}
+		}
+
+		free(cached.data);
+	}
+
+	return 1;
+}
+
+/*
+ * the socket a future process connects to, to take over from this one. replacing: take_over() reached the
+ * process that had it, which lets go of it now
+ */
+int open_handoff_socket(const char* path, int replacing)
+{
+	struct sockaddr_un address;
+	mode_t old_umask;
+	int result, probe_fd = -1;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(address.sun_path) || (handoff_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+		return -1;
+
+	strcpy(address.sun_path, path);
+
+	/*
+	 * otherwise a socket there is only removed if it's left over from a previous run, nobody accepts on it.
+	 * anything else at the path (or another server's handoff socket) makes bind fail instead
+	 */
+	if (is_socket_file(path) && (replacing || ((probe_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) >= 0 && connect(probe_fd, (struct sockaddr*) &address, sizeof(address)) < 0 && errno == ECONNREFUSED)))
+		unlink(path);
+
+	if (probe_fd >= 0)
+		close(probe_fd);
+
+	/* whoever can connect to it can take the server over, it's the owner's only from the start */
+	old_umask = umask(0077);
+	result = bind(handoff_fd, (struct sockaddr*) &address, sizeof(address));
+	umask(old_umask);
+
+	if (result < 0 || listen(handoff_fd, 1) < 0) {
+		close(handoff_fd);
+		handoff_fd = -1;
+		return -1;
+	}
+
+	handoff_inode = inode_of(path);
+
+	return 0;
 }
 
 int main(int argc, char* argv[])
 {
-	int cfd;
+	int cfd, i;
 	socklen_t client_address_length;
-	struct sockaddr_in server_address;
-	struct sockaddr client_address;
+	struct sockaddr_storage client_address;
+	struct pollfd poll_fds[MAX_LISTENERS + 1 + MAX_TRANSFERS + MAX_REPLICATIONS * MAX_PEERS + CATCH_UP_BATCH];
+	int poll_index[MAX_TRANSFERS]; /* where each transfer is in poll_fds */
+	int replication_poll_index[MAX_REPLICATIONS][MAX_PEERS], catch_up_poll_index[CATCH_UP_SIZE]; /* and each peer connection waiting for an answer */
+	int j, slot;
+	int option, poll_count, listener_poll_count, timeout, took_over = 0;
+	double now, resume_at, catch_up_in;
+
+	/* options */
+	while ((option = getopt(argc, argv, "r:l:H:g:G:c:C:d:p:k:a:TS:")) != -1) {
+		switch (option) {
+			case 'r':
+				root_path = optarg;
+				break;
+
+			case 'l':
+				if (listener_count == MAX_LISTENERS) {
+					fprintf(stderr, SERVER_NAME": too many listeners\n");
+					exit(-4);
+				}
+
+				listeners[listener_count++].spec = optarg;
+				break;
+
+			case 'H':
+				handoff_path = optarg;
+				break;
+
+			case 'g':
+				global_read_bucket.rate = parse_rate(optarg);
+				break;
+
+			case 'G':
+				global_upload_bucket.rate = parse_rate(optarg);
+				break;
+
+			case 'c':
+				client_read_rate = parse_rate(optarg);
+				break;
+
+			case 'C':
+				client_upload_rate = parse_rate(optarg);
+				break;
+
+			case 'd':
+				if (strcmp(optarg, "link") == 0) {
+					content_store = C_LINK;
+				} else if (strcmp(optarg, "reflink") == 0) {
+					content_store = C_REFLINK;
+				} else {
+					fprintf(stderr, SERVER_NAME": -d must be link or reflink\n");
+					exit(-4);
+				}
+
+				break;
+
+			case 'p':
+				if (peer_count == MAX_PEERS) {
+					fprintf(stderr, SERVER_NAME": too many peers\n");
+					exit(-4);
+				}
+
+				if (parse_address(optarg, &peers[peer_count].address, &peers[peer_count].address_length) != 0) {
+					fprintf(stderr, SERVER_NAME": bad peer address %s\n", optarg);
+					exit(-4);
+				}
+
+				peers[peer_count].spec = optarg;
+				peers[peer_count++].fd = -1;
+				break;
+
+			case 'k':
+				replica_key = optarg;
+				break;
+
+			case 'a':
+				if (strcmp(optarg, "local") == 0) {
+					ack_policy = A_LOCAL;
+				} else if (strcmp(optarg, "quorum") == 0) {
+					ack_policy = A_QUORUM;
+				} else if (strcmp(optarg, "all") == 0) {
+					ack_policy = A_ALL;
+				} else {
+					fprintf(stderr, SERVER_NAME": -a must be local, quorum or all\n");
+					exit(-4);
+				}
+
+				break;
+
+			case 'T':
+				server_timing = 1;
+				break;
+
+			case 'S':
+				slow_threshold = atof(optarg) / 1000;
+				break;
+
+			default:
+				fprintf(stderr, "usage: %s [-r root] [-l listen address]... [-H handoff socket] [-g|-G|-c|-C bytes per second] [-d link|reflink] [-p peer]... [-k key] [-a local|quorum|all] [-T] [-S slow ms]\n", argv[0]);
+				exit(-4);
+		}
+	}
+
+	if (listener_count == 0)
+		listeners[listener_count++].spec = DEFAULT_LISTENER;
+
+	/* everything served is resolved relative to this */
+	if ((root_fd = open(root_path, O_PATH | O_DIRECTORY)) < 0) {
+		fprintf(stderr, SERVER_NAME": can't open root directory %s\n", root_path);
+		exit(-5);
+	}
+
+	if (content_store != C_NONE && ((mkdir_beneath(RESERVED_PATH, 0755) != 0 && errno != EEXIST) || (mkdir_beneath(OBJECTS_PATH, 0755) != 0 && errno != EEXIST))) {
+		fprintf(stderr, SERVER_NAME": can't create %s/%s\n", root_path, OBJECTS_PATH);
+		exit(-5);
+	}
+
+	expire_uploads();
 
 	/* set running state */
 	running = 1;
 
 	/* set signal callback */
+	/* a client closing early is an error from send()/sendfile(), not a reason to die */
+	signal(SIGPIPE, SIG_IGN);
 	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGALRM, on_drain_timeout);
+
+	/* take the sockets over from the process this one replaces, if there is one */
+	if (handoff_path != NULL && (took_over = take_over(handoff_path)) == 1)
+		fprintf(stderr, SERVER_NAME": took over from the previous process\n");
+
+	/* create sockets */
+	for (i = 0; listener_count > i; i++) {
+		if (!listeners[i].inherited && open_listener(&listeners[i]) < 0) {
+			fprintf(stderr, SERVER_NAME": can't listen on %s\n", listeners[i].spec);
+			exit(-2);
+		}
 
-	/* create socket */    
-	if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		fprintf(stderr, SERVER_NAME": can't create socket\n");
-		exit(-1);
+		poll_fds[i].fd = listeners[i].fd;
+		poll_fds[i].events = POLLIN;
 	}
 
-	/* allow rebinding of socket, need this as a constant value to pass as pointer */
-	const int ALLOW = 1;
+	listener_poll_count = listener_count;
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void*) &ALLOW, sizeof(ALLOW)) < 0)
-		fprintf(stderr, SERVER_NAME": warn: can't set SO_REUSEADDR\n");
+	if (handoff_path != NULL) {
+		if (open_handoff_socket(handoff_path, took_over != 0) < 0) {
+			fprintf(stderr, SERVER_NAME": warn: can't create handoff socket %s\n", handoff_path);
+		} else {
+			poll_fds[listener_poll_count].fd = handoff_fd;
+			poll_fds[listener_poll_count++].events = POLLIN;
+		}
+	}
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void*) &ALLOW, sizeof(ALLOW)) < 0) 
-		fprintf(stderr, SERVER_NAME": warn: can't set SO_REUSEPORT\n");
+	global_read_bucket.updated = global_upload_bucket.updated = monotonic_now();
 
-	/* bind to address */
-	server_address.sin_family = AF_INET;
-	server_address.sin_addr.s_addr = INADDR_ANY;
-	server_address.sin_port = htons(HOST_PORT);
+	/* process loop, once stopped it goes on until the transfers in flight are done and the held clients have their answer */
+	while (running || transfer_count > 0 || replication_count > 0) {
+		/* listeners (while accepting), then the transfers that have something left to send and tokens to send it with */
+		poll_count = running ? listener_poll_count : 0;
+		now = monotonic_now();
+		resume_at = 0;
 
-	if (bind(sfd, (struct sockaddr*) &server_address, sizeof(server_address)) < 0) {
-		fprintf(stderr, SERVER_NAME": can't bind to port %i\n", HOST_PORT);
-		exit(-2);
-	}
+		for (i = 0; MAX_TRANSFERS > i; i++) {
+			poll_index[i] = -1;
 
-	/* listen */
-	if (listen(sfd, BACKLOG) < 0) {
-		fprintf(stderr, SERVER_NAME": could not start listening on port %i\n", HOST_PORT);
-		exit(-3);
-	}
+			if (!transfers[i].active)
+				continue;
 
-	/* process loop */
-	while (running) {
-		if ((cfd = accept(sfd, &client_address, &client_address_length)) < 0 && running) { /* only show warning message when not being shut down */
-			/* could not accept connection */
-			fprintf(stderr, SERVER_NAME": warn: could not accept connection\n");
-			continue;
+			if (transfers[i].resume_at > now) {
+				if (resume_at == 0 || resume_at > transfers[i].resume_at)
+					resume_at = transfers[i].resume_at;
+
+				continue;
+			}
+
+			poll_index[i] = poll_count;
+			poll_fds[poll_count].fd = transfers[i].cfd;
+			poll_fds[poll_count++].events = POLLOUT;
 		}
-		
-		/* handle incoming connection */
-		/* parse it */
-		struct request_t req;
-		enum parse_error parse_error;
-		
-		if ((parse_error = parse_request(cfd, client_address, &req))) {
-			switch (parse_error) {
-				case ERR_UNSUPPORTED_HTTP_VERSION:
-				case ERR_HTTP_VERSION_TOO_BIG:
-					send_response_basic(cfd, "505", "HTTP Version Not Supported");
-					break;
 
-				case ERR_UNSUPPORTED_METHOD:
-				case ERR_METHOD_TOO_BIG:
-					send_response_basic(cfd, "405", "Method Not Allowed");
-					break;
+		/* peers owing an answer to a replicated mutation, until its deadline */
+		for (j = 0; MAX_REPLICATIONS > j; j++) {
+			for (i = 0; peer_count > i; i++) {
+				replication_poll_index[j][i] = -1;
 
-				case ERR_EXPECTING_UNKNOWN:
-					send_response_basic(cfd, "500", "Internal Server Error");
-					break;
+				if (!replications[j].active || replications[j].fds[i] < 0)
+					continue;
 
-				case ERR_TOO_MANY_HEADERS:
-				case ERR_HEADER_VALUE_TOO_BIG:
-				case ERR_HEADER_NAME_TOO_BIG:
-					send_response_basic(cfd, "431", "Request Header Fields Too Large");
-					break;
-				
-				case ERR_EXPECTED_NAME_VALUE_SPACE:
-				case ERR_EXPECTED_NEW_LINE:
-					send_response_basic(cfd, "400", "Bad Request");
-					break;
+				if (resume_at == 0 || resume_at > replications[j].deadline)
+					resume_at = replications[j].deadline;
 
-				case ERR_PATH_TOO_BIG:
-					send_response_basic(cfd, "414", "Request-URI Too Long");
-					break;
+				replication_poll_index[j][i] = poll_count;
+				poll_fds[poll_count].fd = replications[j].fds[i];
+				poll_fds[poll_count++].events = POLLIN;
 			}
-		} else {
-			print_request(req);
-			/* route it & send back response */
-			switch (req.method) {
-				case M_GET:
-					handle_get_request(cfd, req);
-					break;
+		}
 
-				case M_PUT:
-					handle_put_request(cfd, req);
-					break;
+		/* and catch up requests, writable ones while their body goes out then ones with an answer (next_catch_up() has their deadlines), which stop with the server */
+		for (i = 0; catch_up_count > i && running; i++) {
+			slot = (catch_up_head + i) % CATCH_UP_SIZE;
+			catch_up_poll_index[slot] = -1;
 
-				case M_DELETE:
-					handle_delete_request(cfd, req);
-					break;
+			if (!catch_up[slot].used || catch_up[slot].fd < 0)
+				continue;
 
-			}
+			catch_up_poll_index[slot] = poll_count;
+			poll_fds[poll_count].fd = catch_up[slot].fd;
+			poll_fds[poll_count++].events = catch_up[slot].file_fd >= 0 ? POLLOUT : POLLIN;
+		}
+
+		/* wake up for the first transfer to get tokens back, the first peer answer to give up on, or the first peer to catch up */
+		timeout = resume_at > 0 ? (resume_at > now ? (int) ((resume_at - now) * 1000) + 1 : 0) : -1;
+
+		if (running && (catch_up_in = next_catch_up(now)) >= 0 && (timeout < 0 || timeout > (int) (catch_up_in * 1000) + 1))
+			timeout = catch_up_in > 0 ? (int) (catch_up_in * 1000) + 1 : 0;
+
+		if (poll(poll_fds, poll_count, timeout) < 0)
+			continue;
+
+		run_transfers(poll_fds, poll_index);
+
+		if (replication_count > 0)
+			run_replications(poll_fds, replication_poll_index);
+
+		if (running && catch_up_count > 0)
+			run_catch_up(poll_fds, catch_up_poll_index);
+
+		if (!running)
+			continue;
+
+		/* a new process is taking over, stop accepting and finish up */
+		if (handoff_fd >= 0 && poll_fds[listener_poll_count - 1].revents & POLLIN && hand_over()) {
+			handed_off = 1;
+			running = 0;
+			stop_listening();
+			alarm(DRAIN_TIMEOUT);
+			continue;
 		}
 
-		/* close client */
-		close(cfd);
-		shutdown(cfd, SHUT_RDWR);
+		for (i = 0; listener_count > i && running; i++) {
+			if (!(poll_fds[i].revents & POLLIN))
+				continue;
+
+			client_address_length = sizeof(client_address);
+
+			if ((cfd = accept(listeners[i].fd, (struct sockaddr*) &client_address, &client_address_length)) < 0) {
+				/* could not accept connection */
+				fprintf(stderr, SERVER_NAME": warn: could not accept connection\n");
+				continue;
+			}
+			
+			/* handle incoming connection */
+			handle_connection(cfd, client_address);
+
+			/* the scheduler closes it once the transfer is done */
+			if (connection_kept)
+				continue;
+
+			/* close client */
+			close(cfd);
+			shutdown(cfd, SHUT_RDWR);
+		}
 	}
 
+	for (i = 0; peer_count > i; i++)
+		if (peers[i].pending > 0)
+			fprintf(stderr, SERVER_NAME": warn: peer %s is left behind on %d paths\n", peers[i].spec, peers[i].pending);
+
+	/* clean up socket files, unless they are in use by a process that took over */
+	for (i = 0; listener_count > i && !handed_off; i++)
+		if (listeners[i].unix_path[0] && inode_of(listeners[i].unix_path) == listeners[i].unix_inode)
+			unlink(listeners[i].unix_path);
+
+	if (handoff_path != NULL && !handed_off && inode_of(handoff_path) == handoff_inode)
+		unlink(handoff_path);
+
 	return 0;
 }
@@ -0,0 +1,149 @@
+/*
+ * SHA-256 (FIPS 180-4), streaming: sha256_init(), then sha256_update() with the bytes as
+ * they arrive, in pieces of any size, then sha256_final() for the 32 byte digest.
+ * Plain portable C, no dependencies.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256_t
+{
+	uint32_t state[8];
+	uint64_t length; /* bytes hashed so far */
+	unsigned char block[SHA256_BLOCK_SIZE];
+	size_t block_length;
+};
+
+const uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(struct sha256_t* sha)
+{
+	sha->state[0] = 0x6a09e667;
+	sha->state[1] = 0xbb67ae85;
+	sha->state[2] = 0x3c6ef372;
+	sha->state[3] = 0xa54ff53a;
+	sha->state[4] = 0x510e527f;
+	sha->state[5] = 0x9b05688c;
+	sha->state[6] = 0x1f83d9ab;
+	sha->state[7] = 0x5be0cd19;
+	sha->length = 0;
+	sha->block_length = 0;
+}
+
+void sha256_compress(struct sha256_t* sha, const unsigned char* block)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; 16 > i; i++)
+		w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 | (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+
+	for (i = 16; 64 > i; i++)
+		w[i] = (SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10)) + w[i - 7]
+			+ (SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 16];
+
+	a = sha->state[0];
+	b = sha->state[1];
+	c = sha->state[2];
+	d = sha->state[3];
+	e = sha->state[4];
+	f = sha->state[5];
+	g = sha->state[6];
+	h = sha->state[7];
+
+	for (i = 0; 64 > i; i++) {
+		t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+		t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	sha->state[0] += a;
+	sha->state[1] += b;
+	sha->state[2] += c;
+	sha->state[3] += d;
+	sha->state[4] += e;
+	sha->state[5] += f;
+	sha->state[6] += g;
+	sha->state[7] += h;
+}
+
+void sha256_update(struct sha256_t* sha, const void* data, size_t length)
+{
+	const unsigned char* bytes = data;
+	size_t chunk;
+
+	sha->length += length;
+
+	/* top up a block left over from the last call */
+	if (sha->block_length > 0) {
+		chunk = SHA256_BLOCK_SIZE - sha->block_length > length ? length : SHA256_BLOCK_SIZE - sha->block_length;
+		memcpy(sha->block + sha->block_length, bytes, chunk);
+		sha->block_length += chunk;
+		bytes += chunk;
+		length -= chunk;
+
+		if (sha->block_length < SHA256_BLOCK_SIZE)
+			return;
+
+		sha256_compress(sha, sha->block);
+		sha->block_length = 0;
+	}
+
+	/* whole blocks straight from the input */
+	for (; length >= SHA256_BLOCK_SIZE; bytes += SHA256_BLOCK_SIZE, length -= SHA256_BLOCK_SIZE)
+		sha256_compress(sha, bytes);
+
+	memcpy(sha->block, bytes, length);
+	sha->block_length = length;
+}
+
+void sha256_final(struct sha256_t* sha, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	uint64_t bits = sha->length * 8;
+	int i;
+
+	/* a 1 bit, zeros, then the length in bits in the last 8 bytes of a block */
+	sha->block[sha->block_length++] = 0x80;
+
+	if (sha->block_length > SHA256_BLOCK_SIZE - 8) {
+		memset(sha->block + sha->block_length, 0, SHA256_BLOCK_SIZE - sha->block_length);
+		sha256_compress(sha, sha->block);
+		sha->block_length = 0;
+	}
+
+	memset(sha->block + sha->block_length, 0, SHA256_BLOCK_SIZE - 8 - sha->block_length);
+
+	for (i = 0; 8 > i; i++)
+		sha->block[SHA256_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+
+	sha256_compress(sha, sha->block);
+
+	for (i = 0; 8 > i; i++) {
+		digest[i * 4] = sha->state[i] >> 24;
+		digest[i * 4 + 1] = sha->state[i] >> 16;
+		digest[i * 4 + 2] = sha->state[i] >> 8;
+		digest[i * 4 + 3] = sha->state[i];
+	}
+}